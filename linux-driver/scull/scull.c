@@ -1,20 +1,66 @@
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/moduleparam.h>
 
 #include <linux/sched.h>
 #include <linux/kernel.h>	/* printk() */
 #include <linux/types.h>
 #include <linux/fs.h>		/* everything...*/
 #include <linux/cdev.h>
+#include <linux/device.h>	/* class_create(), sysfs attributes */
 #include <linux/proc_fs.h>
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/gfp.h>		/* __get_free_pages() */
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
+#include <linux/mm.h>		/* ZERO_PAGE() */
+#include <linux/nodemask.h>
+#include <linux/topology.h>	/* numa_node_id() */
 #include <linux/seq_file.h>
+#include <linux/kfifo.h>
+#include <linux/ptr_ring.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/uio.h>
+#include <linux/file.h>		/* fdget() */
+#include <linux/refcount.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/sched/mm.h>	/* memalloc_noio_save() */
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
 #include <linux/ioctl.h>
-#include <asm/uaccess.h>	/* copy_*_user */
+#include <linux/uaccess.h>	/* copy_*_user */
+
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
+// Compression of cold quanta needs zsmalloc and LZ4 in the kernel
+#if IS_ENABLED(CONFIG_ZSMALLOC) && IS_ENABLED(CONFIG_LZ4_COMPRESS) && \
+	IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define SCULL_COMPRESS
+#include <linux/zsmalloc.h>
+#include <linux/lz4.h>
+#endif
 
 MODULE_LICENSE("GPL");
 
+/*
+ * Written against Linux 5.15 to 5.18: later kernels drop
+ * blk_cleanup_disk() and QUEUE_FLAG_DISCARD, earlier ones lack
+ * blk_mq_alloc_disk().
+ */
+
 #define SCULL_NR_DEVS 4
 #define SCULL_P_NR_DEVS 4
 /* The bare device is a variable-length region of memory.
@@ -28,7 +74,41 @@ MODULE_LICENSE("GPL");
 #define SCULL_QUANTUM 4000
 #define SCULL_QSET 1000
 
-#define SCULL_P_BUFFER 4000
+/*
+ * scullpipe buffers are vmalloc'ed rings of a power of two bytes, from
+ * a page up to SCULL_P_BUFFER_MAX; each pipe can be resized on its own.
+ */
+#define SCULL_P_BUFFER (64 * 1024)
+#define SCULL_P_BUFFER_MAX (16 * 1024 * 1024)
+
+// Records a scullpipe holds at most in packet mode
+#define SCULL_P_RECORDS 1024
+
+/*
+ * Quantum allocators. Every device picks one of them; the choice can
+ * only change while the device holds no data.
+ *
+ * KMALLOC is the historic behaviour: a 4000-byte quantum lands in
+ * kmalloc-4096 and shares its slabs with everybody else.
+ * CACHE uses a dedicated kmem_cache sized exactly to the quantum.
+ * PAGES takes the quantum straight from the page allocator; it is only
+ * allowed for power-of-two quanta of at least PAGE_SIZE.
+ */
+#define SCULL_ALLOC_KMALLOC	0
+#define SCULL_ALLOC_CACHE	1
+#define SCULL_ALLOC_PAGES	2
+#define SCULL_ALLOC_NR		3
+
+/*
+ * Where quanta are placed on NUMA machines. ANY lets the allocator (and
+ * the mempolicy of the writer) decide, LOCAL asks for the node of the
+ * CPU running the write, INTERLEAVE spreads consecutive quanta over all
+ * the nodes with memory.
+ */
+#define SCULL_NUMA_ANY		0
+#define SCULL_NUMA_LOCAL	1
+#define SCULL_NUMA_INTERLEAVE	2
+#define SCULL_NUMA_NR		3
 
 /*
  * Ioctl definitions
@@ -42,6 +122,9 @@ MODULE_LICENSE("GPL");
  * T means "Tell" directly with the argument value
  * Q means "Query": response is on the return value
  * H means "SHift": switch T and Q atomatically
+ *
+ * Quantum, qset and allocator are per device, and can only be told to
+ * a device holding no data (-EBUSY otherwise).
  */
 #define SCULL_IOCTQUANTUM	_IO(SCULL_IOC_MAGIC, 1)
 #define SCULL_IOCTQSET		_IO(SCULL_IOC_MAGIC, 2)
@@ -49,13 +132,89 @@ MODULE_LICENSE("GPL");
 #define SCULL_IOCQQSET		_IO(SCULL_IOC_MAGIC, 4)
 #define SCULL_IOCHQUANTUM	_IO(SCULL_IOC_MAGIC, 5)
 #define SCULL_IOCHQSET		_IO(SCULL_IOC_MAGIC, 6)
+#define SCULL_IOCTALLOC		_IO(SCULL_IOC_MAGIC, 7)
+#define SCULL_IOCQALLOC		_IO(SCULL_IOC_MAGIC, 8)
+
+/*
+ * Punch a hole: whole quanta in the range are freed, partial ones are
+ * zeroed, the size does not change. This is what fallocate(PUNCH_HOLE)
+ * would do, but the VFS does not pass fallocate() on to char devices.
+ */
+struct scull_punch {
+	__u64 offset;
+	__u64 len;
+};
+#define SCULL_IOCPUNCH		_IOW(SCULL_IOC_MAGIC, 9, struct scull_punch)
+
+#define SCULL_IOCTNUMA		_IO(SCULL_IOC_MAGIC, 10)
+#define SCULL_IOCQNUMA		_IO(SCULL_IOC_MAGIC, 11)
+
+/*
+ * scullpipe only: readers are woken (and poll for POLLIN) once
+ * LOWAT bytes are buffered, writers blocked on a full pipe once the
+ * fill is down to HIWAT. The defaults, 1 and size - 1, give the plain
+ * pipe behaviour.
+ */
+#define SCULL_P_IOCTLOWAT	_IO(SCULL_IOC_MAGIC, 12)
+#define SCULL_P_IOCQLOWAT	_IO(SCULL_IOC_MAGIC, 13)
+#define SCULL_P_IOCTHIWAT	_IO(SCULL_IOC_MAGIC, 14)
+#define SCULL_P_IOCQHIWAT	_IO(SCULL_IOC_MAGIC, 15)
+
+// scullpipe only: buffer size in bytes, rounded up to a power of two
+#define SCULL_P_IOCTSIZE	_IO(SCULL_IOC_MAGIC, 16)
+#define SCULL_P_IOCQSIZE	_IO(SCULL_IOC_MAGIC, 17)
+
+/*
+ * scullpipe only: packet mode. Every write() is queued as one record
+ * and every read() returns one whole record, or fails with EMSGSIZE if
+ * the buffer is too small for it; the records take at most the buffer
+ * size in bytes. The mode can only be changed by the sole opener of an
+ * empty pipe.
+ *
+ * RECV dequeues up to n records in one call, like recvmmsg(): it waits
+ * for the first one (unless O_NONBLOCK), then takes what is there.
+ * It returns the number of records and sets len of each message to the
+ * size of its record.
+ */
+#define SCULL_P_IOCTPACKET	_IO(SCULL_IOC_MAGIC, 18)
+#define SCULL_P_IOCQPACKET	_IO(SCULL_IOC_MAGIC, 19)
+
+struct scull_msg {
+	__u64 buf;	// user buffer
+	__u32 len;	// in: its size, out: size of the record
+	__u32 pad;
+};
+
+struct scull_mbatch {
+	__u64 msgs;	// array of struct scull_msg
+	__u32 n;	// entries in it
+	__u32 pad;
+};
+
+#define SCULL_P_IOCRECV		_IOW(SCULL_IOC_MAGIC, 20, struct scull_mbatch)
+
+/*
+ * Make this device a copy of another scull device, given as an open
+ * file descriptor: arg is the fd. The two then share their quanta and
+ * a quantum is only copied when one of them writes to it. Whatever the
+ * device held before is dropped.
+ */
+#define SCULL_IOCCLONE		_IO(SCULL_IOC_MAGIC, 21)
 
-#define SCULL_IOC_MAXNR 6
+#define SCULL_IOC_MAXNR 21
 
 // Representation of scull quantum sets
 struct scull_qset {
 	void **data;
 	struct scull_qset *next;
+	unsigned long *atime;	// last access of each quantum, for the compactor
+};
+
+// Per-CPU counters of a device, summed when read through debugfs
+struct scull_stats {
+	u64 reads, read_bytes;
+	u64 writes, write_bytes;
+	u64 sleeps, wait_ns;
 };
 
 struct scull_dev {
@@ -63,16 +222,106 @@ struct scull_dev {
 	int quantum;		// the current quantum size
 	int qset;		// the current arrary size
 	unsigned long size;	// amount of data stored here
+	int alloc;		// SCULL_ALLOC_* used for the quanta
+	struct kmem_cache *qcache;	// quantum cache in SCULL_ALLOC_CACHE mode
+	atomic_long_t nquanta;	// quanta currently allocated
+	atomic_long_t qbytes;	// memory really consumed by those quanta
+	atomic_long_t ibytes;	// memory consumed by the qset index
+	int numa;		// SCULL_NUMA_* placement of new quanta
+	int next_node;		// last node used by SCULL_NUMA_INTERLEAVE
+	atomic_long_t *node_bytes;	// quantum memory on each node
+	struct rw_semaphore sem;	// readers share it, writers and trim own it
+	struct list_head dead;	// detached quantum trees waiting to be freed
+	spinlock_t dead_lock;	// protects the dead list
+	struct delayed_work trim_work;	// frees the dead trees in the background
+#ifdef SCULL_COMPRESS
+	struct delayed_work compact_work;	// compresses the cold quanta
+	atomic_long_t nzq;	// compressed quanta
+	atomic_long_t zorig;	// bytes they held
+	atomic_long_t zbytes;	// bytes they take compressed
+	atomic_long_t zfaults;	// compressed quanta accessed again
+	long zfaults_last;	// zfaults at the last compactor run
+	unsigned long zlast;	// jiffies of that run
+	long zfault_rate;	// faults per second between the last two runs
+#endif
+	struct scull_stats __percpu *stats;
+	struct blk_mq_tag_set tag_set;	// of the block device
+	struct gendisk *disk;	// the same data as /dev/scullbN
+	int blk_openers;	// opens of the disk, under sem
 	struct cdev	cdev;	// Char device structure
 };
 
+/*
+ * A quantum used by more than one slot, after a clone. Slots point to
+ * it with the low bit set (quanta themselves are at least word
+ * aligned). It remembers how the quantum was allocated and which
+ * device pays for it; the last reference frees it. A NULL data is the
+ * zero quantum, which every zero-filled quantum written is mapped to.
+ */
+struct scull_shared {
+	refcount_t ref;
+	void *data;
+	int alloc;
+	struct kmem_cache *qcache;
+	int quantum;
+	struct scull_dev *owner;
+};
+
+#define SCULL_SHARED	1UL
+
+/*
+ * A quantum compressed by the compactor, tagged SCULL_ZQ in its slot.
+ * It goes back to a plain quantum on the next access.
+ */
+struct scull_zq {
+	unsigned long handle;	// in scull_zpool
+	unsigned int len;	// compressed size
+	int quantum;		// uncompressed size
+};
+
+#define SCULL_ZQ	2UL
+
+// A quantum tree detached from its device by a trim. It remembers how
+// it was allocated, since the device may have moved on in the meantime.
+struct scull_dead {
+	struct list_head list;
+	struct scull_qset *data;	// first qset still to be freed
+	int pos;			// next quantum to free in data->data
+	int quantum;
+	int qset;
+	int alloc;
+	struct kmem_cache *qcache;
+};
+
+// A kmem_cache shared by all the devices using the same quantum size
+struct scull_qcache {
+	struct list_head list;
+	struct kmem_cache *cache;
+	int size;
+	char name[24];
+};
+
+// One record of a pipe in packet mode
+struct scull_rec {
+	unsigned int len;
+	char data[];
+};
+
 struct scull_pipe {
 	wait_queue_head_t inq, outq;	// read and write queues
-	char *buffer, *end;		// begin of buf, end of buf
-	int buffersize;			// used in pointer arithmetic
-	char *rp, *wp;			// where to read, where to write
+	struct kfifo fifo;		// the circular buffer
+	void *buffer;			// vmalloc'ed storage of the fifo
+	int buffersize;			// size of the fifo, a power of two
+	int rd_lowat;			// readers want at least that many bytes
+	int wr_hiwat;			// writers come back below that fill
 	int nreaders, nwriters;		// number of openings for r/w
-	struct semaphore sem;		// mutual exclusion semaphore
+	struct semaphore sem;		// open, release and configuration
+	struct semaphore rsem;		// readers against each other
+	struct semaphore wsem;		// writers against each other
+	int packet;			// packet mode, see SCULL_P_IOCTPACKET
+	struct ptr_ring ring;		// of struct scull_rec, in packet mode
+	atomic_t pbytes;		// bytes in the records of the ring
+	struct scull_stats __percpu *stats;
 	struct cdev cdev;		// char device structure
 };
 
@@ -80,36 +329,376 @@ struct scull_dev *scull_devices;	// Allocated in scull_init_module
 
 int scull_major = 0;
 int scull_minor = 0;
+// Defaults of freshly loaded devices; each device then has its own
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset = SCULL_QSET;
+int scull_alloc_mode = SCULL_ALLOC_KMALLOC;
+
+module_param(scull_quantum, int, S_IRUGO);
+MODULE_PARM_DESC(scull_quantum, "Default quantum size");
+module_param(scull_qset, int, S_IRUGO);
+MODULE_PARM_DESC(scull_qset, "Default number of quanta per qset");
+module_param(scull_alloc_mode, int, S_IRUGO);
+MODULE_PARM_DESC(scull_alloc_mode, "Default quantum allocator: 0 kmalloc, 1 kmem_cache, 2 pages");
+
+static const char *scull_alloc_names[SCULL_ALLOC_NR] = {
+	"kmalloc", "cache", "pages",
+};
+
+static const char *scull_numa_names[SCULL_NUMA_NR] = {
+	"any", "local", "interleave",
+};
+
+static struct class *scull_class;	// gives the devices a sysfs home
+
+// Quanta freed per trim_work run; the work reschedules itself one jiffy
+// later when a dead tree is bigger than that
+int scull_trim_batch = 4096;
+
+module_param(scull_trim_batch, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(scull_trim_batch, "Quanta freed per jiffy by the background trim");
+
+static struct workqueue_struct *scull_trim_wq;
+
+// Size of the block devices, 0 for none
+int scull_blk_mb = 64;
+
+module_param(scull_blk_mb, int, S_IRUGO);
+MODULE_PARM_DESC(scull_blk_mb, "Size of each /dev/scullbN block device in MB (0: none)");
+
+static int scull_blk_major;
+
+#ifdef SCULL_COMPRESS
+// Quanta not accessed for that long are compressed; 0 turns it off
+int scull_compress_ms = 0;
+
+module_param(scull_compress_ms, int, S_IRUGO);
+MODULE_PARM_DESC(scull_compress_ms, "Compress quanta idle for that many ms (0: never)");
+
+static struct zs_pool *scull_zpool;
+#endif
+
+// The zero quantum: it is never freed, the initial reference stays
+static struct scull_shared scull_zero = {
+	.ref	= REFCOUNT_INIT(1),
+};
+
+static LIST_HEAD(scull_qcaches);
+static DEFINE_MUTEX(scull_qcache_lock);
 
 int scull_p_nr_devs = SCULL_P_NR_DEVS;	// number of pipe devices
 int scull_p_buffer = SCULL_P_BUFFER;	// buffer size
+module_param(scull_p_buffer, int, S_IRUGO);
+MODULE_PARM_DESC(scull_p_buffer, "Default scullpipe buffer size");
 dev_t scull_p_devno;
 
 struct scull_pipe *scull_p_devices;
 
-ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+static struct dentry *scull_debugfs;	// /sys/kernel/debug/scull
+
+/*
+ * Splice support. Pages handed to a pipe are plain references: the
+ * pipe drops them with put_page() once they are consumed.
+ */
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+	.release	= generic_pipe_buf_release,
+	.get		= generic_pipe_buf_get,
+};
+
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+	put_page(spd->pages[i]);
+}
+
+// How many buffers the pipe can still take; the splice core holds the
+// pipe lock around ->splice_read, so this does not change under us
+static unsigned int scull_pipe_space(struct pipe_inode_info *pipe) {
+	unsigned int used = pipe_occupancy(pipe->head, pipe->tail);
+
+	return used < pipe->max_usage ? pipe->max_usage - used : 0;
+}
+
+// Account for a pipe reader (writer) going to sleep; returns the time
+// to hand to scull_p_woken()
+static u64 scull_p_sleep(struct scull_pipe *dev, int writer) {
+	trace_scull_sleep(dev->cdev.dev, writer);
+	this_cpu_inc(dev->stats->sleeps);
+	return ktime_get_ns();
+}
+
+static void scull_p_woken(struct scull_pipe *dev, int writer, u64 t0) {
+	u64 ns = ktime_get_ns() - t0;
+
+	trace_scull_wake(dev->cdev.dev, writer, ns);
+	this_cpu_add(dev->stats->wait_ns, ns);
+}
+
+// Is there something worth waking a reader for? A batch of rd_lowat
+// bytes, or whatever is left once the last writer is gone.
+static int scull_p_readable(struct scull_pipe *dev) {
+	unsigned int len = kfifo_len(&dev->fifo);
+
+	return len && (len >= dev->rd_lowat || !dev->nwriters);
+}
+
+// Writers are let in again once the fill drops to wr_hiwat
+static int scull_p_writable(struct scull_pipe *dev) {
+	return kfifo_len(&dev->fifo) <= dev->wr_hiwat;
+}
+
+/*
+ * kfifo has no iov_iter interface: move data between the ring and an
+ * iov_iter ourselves, one segment on each side of the wrap point, with
+ * the barriers kfifo_to_user() and kfifo_from_user() use.
+ */
+static size_t scull_p_fifo_to_iter(struct kfifo *fifo, struct iov_iter *to) {
+	struct __kfifo *k = &fifo->kfifo;
+	unsigned int len = min_t(size_t, kfifo_len(fifo), iov_iter_count(to));
+	unsigned int off = k->out & k->mask;
+	unsigned int l = min(len, k->mask + 1 - off);
+	size_t n;
+
+	smp_rmb();	// the data is read after the writer's in
+	n = copy_to_iter(k->data + off, l, to);
+	if (n == l && len > l) {
+		n += copy_to_iter(k->data, len - l, to);
+	}
+	smp_mb();	// and before the writer may reuse the space
+	k->out += n;
+	return n;
+}
+
+static size_t scull_p_iter_to_fifo(struct kfifo *fifo, struct iov_iter *from) {
+	struct __kfifo *k = &fifo->kfifo;
+	unsigned int len = min_t(size_t, kfifo_avail(fifo), iov_iter_count(from));
+	unsigned int off = k->in & k->mask;
+	unsigned int l = min(len, k->mask + 1 - off);
+	size_t n;
+
+	n = copy_from_iter(k->data + off, l, from);
+	if (n == l && len > l) {
+		n += copy_from_iter(k->data, len - l, from);
+	}
+	smp_wmb();	// the data is there before readers see in move
+	k->in += n;
+	return n;
+}
+
+// Take sem for a read or write; IOCB_NOWAIT callers never sleep on it
+static int scull_p_lock(struct semaphore *sem, struct kiocb *iocb) {
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		return down_trylock(sem) ? -EAGAIN : 0;
+	}
+	return down_interruptible(sem) ? -ERESTARTSYS : 0;
+}
+
+/*
+ * Packet mode. Records go through a ptr_ring: producers and consumers
+ * each serialize on the ring's own spinlocks only for the pointer
+ * exchange, the copies to and from user space are done outside.
+ */
+static void scull_p_free_rec(void *rec) {
+	kfree(rec);
+}
+
+// Is there room for a record of len bytes?
+static int scull_p_room(struct scull_pipe *dev, size_t len) {
+	return atomic_read(&dev->pbytes) + len <= dev->buffersize &&
+		!ptr_ring_full(&dev->ring);
+}
+
+// Queue rec if both the byte budget and the ring have room for it
+static int scull_p_post(struct scull_pipe *dev, struct scull_rec *rec) {
+	if (atomic_add_return(rec->len, &dev->pbytes) <= dev->buffersize &&
+			!ptr_ring_produce(&dev->ring, rec)) {
+		return 1;
+	}
+	atomic_sub(rec->len, &dev->pbytes);
+	// we may have kept another writer from seeing room
+	smp_mb();
+	if (waitqueue_active(&dev->outq)) {
+		wake_up_interruptible(&dev->outq);
+	}
+	return 0;
+}
+
+// Dequeue the next record if it fits in count bytes. NULL if there is
+// none, ERR_PTR(-EMSGSIZE) if it does not fit.
+static struct scull_rec *scull_p_take(struct scull_pipe *dev, size_t count) {
+	struct scull_rec *rec;
+
+	spin_lock(&dev->ring.consumer_lock);
+	rec = __ptr_ring_peek(&dev->ring);
+	if (rec && rec->len > count) {
+		rec = ERR_PTR(-EMSGSIZE);
+	} else if (rec) {
+		__ptr_ring_discard_one(&dev->ring);
+	}
+	spin_unlock(&dev->ring.consumer_lock);
+	return rec;
+}
+
+// Read one record into to; the record is gone even if the copy faults
+static ssize_t scull_p_recv(struct scull_pipe *dev, struct iov_iter *to,
+		int nonblock) {
+	size_t count = iov_iter_count(to);
+	struct scull_rec *rec;
+	ssize_t ret;
+	u64 t0;
+
+	while (!(rec = scull_p_take(dev, count))) {
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		t0 = scull_p_sleep(dev, 0);
+		ret = wait_event_interruptible(dev->inq, !ptr_ring_empty(&dev->ring));
+		scull_p_woken(dev, 0, t0);
+		if (ret) {
+			return -ERESTARTSYS;
+		}
+	}
+	if (IS_ERR(rec)) {
+		return PTR_ERR(rec);
+	}
+
+	atomic_sub(rec->len, &dev->pbytes);
+	ret = copy_to_iter(rec->data, rec->len, to) != rec->len ? -EFAULT : rec->len;
+	kfree(rec);
+
+	smp_mb();
+	if (waitqueue_active(&dev->outq)) {
+		wake_up_interruptible(&dev->outq);
+	}
+	if (ret >= 0) {
+		trace_scull_pipe_read(dev->cdev.dev, count, ret, atomic_read(&dev->pbytes));
+		this_cpu_inc(dev->stats->reads);
+		this_cpu_add(dev->stats->read_bytes, ret);
+	}
+	return ret;
+}
+
+// Queue what from holds as one record
+static ssize_t scull_p_send(struct scull_pipe *dev, struct iov_iter *from,
+		int nonblock) {
+	size_t count = iov_iter_count(from);
+	struct scull_rec *rec;
+	int ret;
+	u64 t0;
+
+	if (count > dev->buffersize) {
+		return -EMSGSIZE;
+	}
+	rec = kmalloc(sizeof(*rec) + count, GFP_KERNEL);
+	if (!rec) {
+		return -ENOMEM;
+	}
+	rec->len = count;
+	if (copy_from_iter(rec->data, count, from) != count) {
+		kfree(rec);
+		return -EFAULT;
+	}
+
+	while (!scull_p_post(dev, rec)) {
+		if (nonblock) {
+			kfree(rec);
+			return -EAGAIN;
+		}
+		t0 = scull_p_sleep(dev, 1);
+		ret = wait_event_interruptible(dev->outq, scull_p_room(dev, count));
+		scull_p_woken(dev, 1, t0);
+		if (ret) {
+			kfree(rec);
+			return -ERESTARTSYS;
+		}
+	}
+
+	smp_mb();
+	if (waitqueue_active(&dev->inq)) {
+		wake_up_interruptible(&dev->inq);
+	}
+	trace_scull_pipe_write(dev->cdev.dev, count, count, atomic_read(&dev->pbytes));
+	this_cpu_inc(dev->stats->writes);
+	this_cpu_add(dev->stats->write_bytes, count);
+	return count;
+}
+
+// SCULL_P_IOCRECV: up to n records in one call
+static long scull_p_recv_batch(struct scull_pipe *dev, struct file *filp,
+		struct scull_mbatch __user *arg) {
+	struct scull_msg __user *umsg;
+	struct scull_mbatch batch;
+	struct scull_msg msg;
+	struct iov_iter to;
+	struct iovec iov;
+	ssize_t ret = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, arg, sizeof(batch))) {
+		return -EFAULT;
+	}
+	umsg = u64_to_user_ptr(batch.msgs);
+
+	for (i = 0; i < batch.n; i++) {
+		if (copy_from_user(&msg, &umsg[i], sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = import_single_range(READ, u64_to_user_ptr(msg.buf), msg.len,
+				&iov, &to);
+		if (ret < 0) {
+			break;
+		}
+		// Only the first record is waited for
+		ret = scull_p_recv(dev, &to, i || (filp->f_flags & O_NONBLOCK));
+		if (ret < 0) {
+			break;
+		}
+		msg.len = ret;
+		if (put_user(msg.len, &umsg[i].len)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	return i ? i : ret;
+}
+
+ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	struct file *filp = iocb->ki_filp;
 	struct scull_pipe *dev = filp->private_data;
+	int nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	size_t count = iov_iter_count(to);
+	size_t copied;
+	int ret;
+	u64 t0;
+
+	if (dev->packet) {
+		return scull_p_recv(dev, to, nonblock);
+	}
 
-	if (down_interruptible(&dev->sem)) {
-		return -ERESTARTSYS;
+	// Only readers exclude each other: the kfifo needs no locking
+	// between one reader and one writer
+	ret = scull_p_lock(&dev->rsem, iocb);
+	if (ret) {
+		return ret;
 	}
 
-	// The while loop tests the buffer with the device semaphore held.
+	// The while loop tests the buffer with the read semaphore held.
 	// If there is data there, we know we can return it to the user 
 	// immediately without sleeping, so the entire body of the loop is
-	// skipped.
-	while(dev->rp == dev->wp) { // Nothing to read
-		up(&dev->sem); // Release the lock
-
-		// Return if the user has requested non-blocking I/O
-		if (filp->f_flags & O_NONBLOCK) {
+	// skipped. A non-blocking reader takes whatever is there, a
+	// blocking one waits for a batch of rd_lowat bytes.
+	while (kfifo_is_empty(&dev->fifo) ||
+			(!nonblock && !scull_p_readable(dev))) {
+		up(&dev->rsem); // Release the lock
+
+		// Return if the user has requested non-blocking I/O. Both
+		// O_NONBLOCK and IOCB_NOWAIT end up here; io_uring then
+		// waits for POLLIN and tries again.
+		if (nonblock) {
 			return -EAGAIN;
 		}
 
 		// Otherwise go to sleep
-		printk("scullpipe: reading go to sleep");
+		t0 = scull_p_sleep(dev, 0);
 
 		// Something has awakened us but we do not know that.
 		// One possibility is that the process received a signal.
@@ -122,7 +711,9 @@ ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *
 		// driver returns -ERESTARTSYS to the caller; this value is used
 		// internally by the virtual filesystem (VFS) layer, which either
 		// restart the system call or returns -EINTR to user space.
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))	{
+		ret = wait_event_interruptible(dev->inq, scull_p_readable(dev));
+		scull_p_woken(dev, 0, t0);
+		if (ret) {
 			return -ERESTARTSYS;	// signal: tell the fs layer to handle it
 		}
 
@@ -133,72 +724,60 @@ ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *
 		// semaphore again; only then can we test the read buffer again
 		// (in the while loop) and truly know that we can return the
 		// data in the buffer to the user.
-		if (down_interruptible(&dev->sem)) {
+		if (down_interruptible(&dev->rsem)) {
 			return -ERESTARTSYS;
 		}
 	}
 
 	// We know that the semaphore is held and the buffer contains data
-	// that we can use. We can now read the data
-	if (dev->wp > dev->rp) {
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	} else {
-		// the write point has wrapped, return data up to dev->end
-		count = min(count, (size_t)(dev->end - dev->rp));
-	}
-
-	if (copy_to_user(buf, dev->rp, count)) {
-		up(&dev->sem);
+	// that we can use; both halves of a wrapped region are copied.
+	copied = scull_p_fifo_to_iter(&dev->fifo, to);
+	up(&dev->rsem);
+	if (!copied && count) {
 		return -EFAULT;
 	}
 
-	dev->rp += count;
-	if (dev->rp == dev->end) {
-		// wrapped
-		dev->rp = dev->buffer;
+	// finally, awaken any writers and return. They sleep on a full
+	// buffer and only want to hear about it once it drained to wr_hiwat.
+	// The barrier orders the read of the queue after our update of the
+	// fifo; prepare_to_wait() on the other side has the matching one.
+	smp_mb();
+	if (waitqueue_active(&dev->outq) && scull_p_writable(dev)) {
+		wake_up_interruptible(&dev->outq);
 	}
+	trace_scull_pipe_read(dev->cdev.dev, count, copied, kfifo_len(&dev->fifo));
+	this_cpu_inc(dev->stats->reads);
+	this_cpu_add(dev->stats->read_bytes, copied);
 
-	up(&dev->sem);
-
-	// finally, awaken any writers and return
-	wake_up_interruptible(&dev->outq);
-	printk("scullpipe: read %li bytes\n", (long)count);
-
-	return count;
-}
-
-// How much space is free
-int spacefree(struct scull_pipe *dev) {
-	if (dev->rp == dev->wp) {
-		return dev->buffersize - 1;
-	}
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	return copied;
 }
 
-// Wait for space for writing; caller must hold device semaphore. On
+// Wait for space for writing; caller must hold the write semaphore. On
 // error the semaphore will be released before returning
-int scull_getwritespace(struct scull_pipe *dev, struct file *filp) {
-	while(spacefree(dev) == 0) { // full
+int scull_getwritespace(struct scull_pipe *dev, int nonblock) {
+	while(kfifo_is_full(&dev->fifo)) { // full
 		DEFINE_WAIT(wait);
+		u64 t0;
 
-		up(&dev->sem);
-		if (filp->f_flags & O_NONBLOCK) {
+		up(&dev->wsem);
+		if (nonblock) {
 			return -EAGAIN;
 		}
-		printk("writing: going to sleep\n");
+		t0 = scull_p_sleep(dev, 1);
 
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0) {
+		if (!scull_p_writable(dev)) {
 			schedule();
 		}
 
 		finish_wait(&dev->outq, &wait);
+		scull_p_woken(dev, 1, t0);
 
 		// Signal: tell the fs layer to handle it
 		if (signal_pending(current)) {
 			return -ERESTARTSYS;
 		}
-		if (down_interruptible(&dev->sem)) {
+		if (down_interruptible(&dev->wsem)) {
 			return -ERESTARTSYS;
 		}
 	}
@@ -206,123 +785,487 @@ int scull_getwritespace(struct scull_pipe *dev, struct file *filp) {
 	return 0;
 }
 
-ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_ops) {
+ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	struct file *filp = iocb->ki_filp;
 	struct scull_pipe *dev = filp->private_data;
+	int nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	size_t count = iov_iter_count(from);
+	size_t copied;
 	int result;
 
-	if (down_interruptible(&dev->sem)) {
-		return -ERESTARTSYS;
+	if (dev->packet) {
+		return scull_p_send(dev, from, nonblock);
 	}
 
-	// Make sure there's space to write
-	result = scull_getwritespace(dev, filp);
+	result = scull_p_lock(&dev->wsem, iocb);
 	if (result) {
-		// scull_getwritespace called up(&dev->sem)
 		return result;
 	}
 
-	// ok, space there, accept something
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp) {
-		count = min(count, (size_t)(dev->end - dev->wp)); // to end-of-buffer
-	} else {
-		// the write pointer has wrapped, fill up to rp-1
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
+	// Make sure there's space to write
+	result = scull_getwritespace(dev, nonblock);
+	if (result) {
+		// scull_getwritespace called up(&dev->wsem)
+		return result;
 	}
-	printk("scullpipe: accept %li bytes\n", (long)count);
 
-	if (copy_from_user(dev->wp, buf, count)) {
-		up(&dev->sem);
+	// ok, space there, accept something: up to the end of the buffer
+	// and then from its beginning in the same call
+	copied = scull_p_iter_to_fifo(&dev->fifo, from);
+	up(&dev->wsem);
+	if (!copied && count) {
 		return -EFAULT;
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end) {
-		dev->wp = dev->buffer; // wrapped
-	}
-	up(&dev->sem);
 
-	// finally, awake any reader
-	wake_up_interruptible(&dev->inq);	// blocked in read() and select()
-	printk("scullpipe: write %li bytes\n", (long)count);
+	// finally, awake any reader blocked in read() and select(), but
+	// only once a batch of rd_lowat bytes is waiting
+	smp_mb();
+	if (waitqueue_active(&dev->inq) && scull_p_readable(dev)) {
+		wake_up_interruptible(&dev->inq);
+	}
+	trace_scull_pipe_write(dev->cdev.dev, count, copied, kfifo_len(&dev->fifo));
+	this_cpu_inc(dev->stats->writes);
+	this_cpu_add(dev->stats->write_bytes, copied);
 
-	return count;
+	return copied;
 }
 
-int scull_p_open(struct inode *inode, struct file *filp) {
-	struct scull_pipe *dev;
+__poll_t scull_p_poll(struct file *filp, poll_table *wait) {
+	struct scull_pipe *dev = filp->private_data;
+	__poll_t mask = 0;
+
+	// The buffer is circular; it is considered full if there is no
+	// room left, and readable only once a batch is there. Same rules
+	// as the wakeups above, so a poller is never woken for nothing.
+	poll_wait(filp, &dev->inq, wait);
+	poll_wait(filp, &dev->outq, wait);
+	if (dev->packet) {
+		if (!ptr_ring_empty(&dev->ring)) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+		if (scull_p_room(dev, 1)) {
+			mask |= EPOLLOUT | EPOLLWRNORM;
+		}
+		return mask;
+	}
+	if (scull_p_readable(dev)) {
+		mask |= EPOLLIN | EPOLLRDNORM;	// readable
+	}
+	if (!kfifo_is_full(&dev->fifo) && scull_p_writable(dev)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;	// writable
+	}
+	return mask;
+}
 
-	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-	filp->private_data = dev;
+// Move data from the scullpipe into a pipe. The bytes are copied once
+// into fresh pages, never through user space. No more pages are filled
+// than the pipe can take, so nothing leaves the fifo to be lost.
+ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+	struct scull_pipe *dev = filp->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+		.ops		= &scull_pipe_buf_ops,
+		.spd_release	= scull_spd_release,
+	};
+	int nonblock = (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+	unsigned int space, chunk;
+	ssize_t ret;
+	u64 t0;
+
+	if (dev->packet) {
+		return -EINVAL;	// records do not map onto pipe buffers
+	}
+	space = min(scull_pipe_space(pipe), (unsigned int)PIPE_DEF_BUFFERS);
+	if (!space) {
+		return -EAGAIN;
+	}
 
-	if (down_interruptible(&dev->sem)) {
+	if (down_interruptible(&dev->rsem)) {
 		return -ERESTARTSYS;
 	}
-	if (!dev->buffer) {
-		// allocate the buffer
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-		if (!dev->buffer) {
-			up(&dev->sem);
-			return -ENOMEM;
+	// Same rules as scull_p_read_iter()
+	while (kfifo_is_empty(&dev->fifo) || (!nonblock && !scull_p_readable(dev))) {
+		up(&dev->rsem);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		t0 = scull_p_sleep(dev, 0);
+		ret = wait_event_interruptible(dev->inq, scull_p_readable(dev));
+		scull_p_woken(dev, 0, t0);
+		if (ret) {
+			return -ERESTARTSYS;
+		}
+		if (down_interruptible(&dev->rsem)) {
+			return -ERESTARTSYS;
 		}
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; // rd and wr from the beginning
 
-	if (filp->f_mode & FMODE_READ) {
-		dev->nreaders++;
+	while (len && spd.nr_pages < space && !kfifo_is_empty(&dev->fifo)) {
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		if (!page) {
+			break;
+		}
+		chunk = kfifo_out(&dev->fifo, page_address(page),
+				min(len, (size_t)PAGE_SIZE));
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		len -= chunk;
 	}
-	if (filp->f_mode & FMODE_WRITE) {
-		dev->nwriters++;
+	up(&dev->rsem);
+
+	if (!spd.nr_pages) {
+		return -ENOMEM;
 	}
-	up(&dev->sem);
 
-	printk("scullpipe: open successfully\n");
+	smp_mb();
+	if (waitqueue_active(&dev->outq) && scull_p_writable(dev)) {
+		wake_up_interruptible(&dev->outq);
+	}
 
-	return nonseekable_open(inode, filp);
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0) {
+		trace_scull_pipe_read(dev->cdev.dev, ret, ret, kfifo_len(&dev->fifo));
+		this_cpu_inc(dev->stats->reads);
+		this_cpu_add(dev->stats->read_bytes, ret);
+	}
+	return ret;
 }
 
-// The file operations for the pipe device
-struct file_operations scull_pipe_fops = {
-	.owner	=	THIS_MODULE,
-	.open	= 	scull_p_open,
-	.read	=	scull_p_read,
-	.write	=	scull_p_write,
-};
+// Feed one pipe buffer to the fifo, waiting for room if need be
+static int scull_p_splice_actor(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf, struct splice_desc *sd) {
+	struct scull_pipe *dev = sd->u.file->private_data;
+	unsigned int n;
+	void *data;
+	int ret;
+	u64 t0;
+
+	while (kfifo_is_full(&dev->fifo)) {
+		if ((sd->flags & SPLICE_F_NONBLOCK) ||
+				(sd->u.file->f_flags & O_NONBLOCK)) {
+			return -EAGAIN;
+		}
+		t0 = scull_p_sleep(dev, 1);
+		ret = wait_event_interruptible(dev->outq, !kfifo_is_full(&dev->fifo) &&
+				scull_p_writable(dev));
+		scull_p_woken(dev, 1, t0);
+		if (ret) {
+			return -ERESTARTSYS;
+		}
+	}
 
-// Set up a cdev entry
-void scull_p_setup_cdev(struct scull_pipe *dev, int index) {
-	int err, devno = scull_p_devno + index;
+	ret = pipe_buf_confirm(pipe, buf);
+	if (ret) {
+		return ret;
+	}
 
-	cdev_init(&dev->cdev, &scull_pipe_fops);
-	dev->cdev.owner = THIS_MODULE;
-	err = cdev_add(&dev->cdev, devno, 1);
-	// Fail gracefully if need be
-	if (err) {
-		printk("Error %d adding scullpipe%d", err, index);
+	data = kmap_local_page(buf->page);
+	n = kfifo_in(&dev->fifo, data + buf->offset, sd->len);
+	kunmap_local(data);
+
+	// a batch may be ready before the whole splice is over
+	smp_mb();
+	if (waitqueue_active(&dev->inq) && scull_p_readable(dev)) {
+		wake_up_interruptible(&dev->inq);
 	}
+	return n;
 }
 
-// Initialize the pipe devs; return how many we did
-int scull_p_init(dev_t firstdev) {
-	int i, result;
+// Move data from a pipe into the scullpipe, one copy straight from the
+// pipe pages into the fifo
+ssize_t scull_p_splice_write(struct pipe_inode_info *pipe, struct file *filp,
+		loff_t *ppos, size_t len, unsigned int flags) {
+	struct scull_pipe *dev = filp->private_data;
+	ssize_t ret;
 
-	result = register_chrdev_region(firstdev, scull_p_nr_devs, "scullp");
-	if (result < 0) {
-		printk("Unable to get scullp region, error %d\n", result);
-		return 0;
+	if (dev->packet) {
+		return -EINVAL;
 	}
-	scull_p_devno = firstdev;
-	scull_p_devices = kmalloc(scull_p_nr_devs * sizeof(struct scull_pipe), GFP_KERNEL);
-	if (scull_p_devices == NULL) {
-		unregister_chrdev_region(firstdev, scull_p_nr_devs);
+	if (down_interruptible(&dev->wsem)) {
+		return -ERESTARTSYS;
+	}
+	ret = splice_from_pipe(pipe, filp, ppos, len, flags, scull_p_splice_actor);
+	up(&dev->wsem);
+	if (ret > 0) {
+		trace_scull_pipe_write(dev->cdev.dev, len, ret, kfifo_len(&dev->fifo));
+		this_cpu_inc(dev->stats->writes);
+		this_cpu_add(dev->stats->write_bytes, ret);
+	}
+
+	return ret;
+}
+
+// Give the pipe a buffer of size bytes, carrying over what the old one
+// holds. The caller holds sem, and rsem and wsem if the pipe is in use.
+static int scull_p_resize(struct scull_pipe *dev, unsigned long size) {
+	int old = dev->buffersize;
+	struct kfifo fifo;
+	unsigned int len;
+	void *buffer;
+
+	if (size < PAGE_SIZE || size > SCULL_P_BUFFER_MAX) {
+		return -EINVAL;
+	}
+	size = roundup_pow_of_two(size);
+	if (size == old) {
+		return 0;
+	}
+	len = dev->buffer ? kfifo_len(&dev->fifo) : 0;
+	if (len > size) {
+		return -EBUSY;
+	}
+
+	buffer = vmalloc(size);
+	if (!buffer) {
+		return -ENOMEM;
+	}
+	// Both segments of the old ring land at the start of the new one
+	if (len) {
+		kfifo_out(&dev->fifo, buffer, len);
+	}
+	kfifo_init(&fifo, buffer, size);
+	kfifo_dma_in_finish(&fifo, len);
+
+	vfree(dev->buffer);
+	dev->fifo = fifo;
+	dev->buffer = buffer;
+	dev->buffersize = size;
+	// Keep the water marks within the new size; the default high mark
+	// follows the size
+	dev->rd_lowat = min(dev->rd_lowat, dev->buffersize);
+	if (!old || dev->wr_hiwat == old - 1 || dev->wr_hiwat >= dev->buffersize) {
+		dev->wr_hiwat = dev->buffersize - 1;
+	}
+	return 0;
+}
+
+// Pipe specific ioctls: the water marks and the buffer size
+long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct scull_pipe *dev = filp->private_data;
+	int ret;
+
+	if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) {
+		return -ENOTTY;
+	}
+
+	switch (cmd) {
+	case SCULL_P_IOCTSIZE:
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		// Keep readers and writers out while the ring is swapped
+		if (down_interruptible(&dev->rsem)) {
+			return -ERESTARTSYS;
+		}
+		if (down_interruptible(&dev->wsem)) {
+			up(&dev->rsem);
+			return -ERESTARTSYS;
+		}
+		down(&dev->sem);
+		ret = scull_p_resize(dev, arg);
+		up(&dev->sem);
+		up(&dev->wsem);
+		up(&dev->rsem);
+		if (ret) {
+			return ret;
+		}
+		break;
+
+	case SCULL_P_IOCQSIZE:
+		return READ_ONCE(dev->buffersize);
+
+	case SCULL_P_IOCTPACKET:
+		down(&dev->sem);
+		// Nobody else may be in read() or write() as the mode flips
+		if (dev->nreaders + dev->nwriters != !!(filp->f_mode & FMODE_READ) +
+					!!(filp->f_mode & FMODE_WRITE) ||
+				!kfifo_is_empty(&dev->fifo) ||
+				(dev->ring.queue && !ptr_ring_empty(&dev->ring))) {
+			up(&dev->sem);
+			return -EBUSY;
+		}
+		ret = 0;
+		if (arg && !dev->ring.queue) {
+			ret = ptr_ring_init(&dev->ring, SCULL_P_RECORDS, GFP_KERNEL);
+		}
+		if (!ret) {
+			dev->packet = !!arg;
+		}
+		up(&dev->sem);
+		return ret;
+
+	case SCULL_P_IOCQPACKET:
+		return dev->packet;
+
+	case SCULL_P_IOCRECV:
+		if (!dev->packet) {
+			return -EINVAL;
+		}
+		return scull_p_recv_batch(dev, filp, (struct scull_mbatch __user *)arg);
+
+	case SCULL_P_IOCTLOWAT:
+		// Checked against the size under the lock a resize takes
+		if (down_interruptible(&dev->sem)) {
+			return -ERESTARTSYS;
+		}
+		if (arg < 1 || arg > dev->buffersize) {
+			up(&dev->sem);
+			return -EINVAL;
+		}
+		dev->rd_lowat = arg;
+		up(&dev->sem);
+		break;
+
+	case SCULL_P_IOCQLOWAT:
+		return dev->rd_lowat;
+
+	case SCULL_P_IOCTHIWAT:
+		if (down_interruptible(&dev->sem)) {
+			return -ERESTARTSYS;
+		}
+		if (arg >= dev->buffersize) {
+			up(&dev->sem);
+			return -EINVAL;
+		}
+		dev->wr_hiwat = arg;
+		up(&dev->sem);
+		break;
+
+	case SCULL_P_IOCQHIWAT:
+		return dev->wr_hiwat;
+
+	default:
+		return -ENOTTY;
+	}
+
+	// The new marks may let somebody in
+	wake_up_interruptible(&dev->inq);
+	wake_up_interruptible(&dev->outq);
+	return 0;
+}
+
+int scull_p_open(struct inode *inode, struct file *filp) {
+	struct scull_pipe *dev;
+
+	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
+	filp->private_data = dev;
+
+	if (down_interruptible(&dev->sem)) {
+		return -ERESTARTSYS;
+	}
+	if (!dev->buffer) {
+		// allocate the buffer
+		int ret = scull_p_resize(dev, clamp_t(unsigned long, scull_p_buffer,
+					PAGE_SIZE, SCULL_P_BUFFER_MAX));
+
+		if (ret) {
+			up(&dev->sem);
+			return ret;
+		}
+		dev->rd_lowat = 1;
+	}
+
+	if (filp->f_mode & FMODE_READ) {
+		dev->nreaders++;
+	}
+	if (filp->f_mode & FMODE_WRITE) {
+		dev->nwriters++;
+	}
+	up(&dev->sem);
+
+	printk("scullpipe: open successfully\n");
+
+	filp->f_mode |= FMODE_NOWAIT;	// read_iter/write_iter honor IOCB_NOWAIT
+	return nonseekable_open(inode, filp);
+}
+
+int scull_p_release(struct inode *inode, struct file *filp) {
+	struct scull_pipe *dev = filp->private_data;
+
+	down(&dev->sem);
+	if (filp->f_mode & FMODE_READ) {
+		dev->nreaders--;
+	}
+	if (filp->f_mode & FMODE_WRITE) {
+		dev->nwriters--;
+	}
+	up(&dev->sem);
+
+	// Without writers a partial batch is all readers will ever get
+	if (!dev->nwriters) {
+		wake_up_interruptible(&dev->inq);
+	}
+	return 0;
+}
+
+// The file operations for the pipe device
+struct file_operations scull_pipe_fops = {
+	.owner	=	THIS_MODULE,
+	.open	= 	scull_p_open,
+	.release =	scull_p_release,
+	.read_iter =	scull_p_read_iter,
+	.write_iter =	scull_p_write_iter,
+	.poll	=	scull_p_poll,
+	.unlocked_ioctl = scull_p_ioctl,
+	.splice_read =	scull_p_splice_read,
+	.splice_write =	scull_p_splice_write,
+};
+
+// Set up a cdev entry
+void scull_p_setup_cdev(struct scull_pipe *dev, int index) {
+	int err, devno = scull_p_devno + index;
+
+	cdev_init(&dev->cdev, &scull_pipe_fops);
+	dev->cdev.owner = THIS_MODULE;
+	err = cdev_add(&dev->cdev, devno, 1);
+	// Fail gracefully if need be
+	if (err) {
+		printk("Error %d adding scullpipe%d", err, index);
+	}
+}
+
+// Initialize the pipe devs; return how many we did
+int scull_p_init(dev_t firstdev) {
+	int i, result;
+
+	result = register_chrdev_region(firstdev, scull_p_nr_devs, "scullp");
+	if (result < 0) {
+		printk("Unable to get scullp region, error %d\n", result);
+		return 0;
+	}
+	scull_p_devno = firstdev;
+	scull_p_devices = kmalloc(scull_p_nr_devs * sizeof(struct scull_pipe), GFP_KERNEL);
+	if (scull_p_devices == NULL) {
+		unregister_chrdev_region(firstdev, scull_p_nr_devs);
 		return 0;
 	}
 	memset(scull_p_devices, 0, scull_p_nr_devs * sizeof(struct scull_pipe));
+	for (i = 0; i < scull_p_nr_devs; i++) {
+		scull_p_devices[i].stats = alloc_percpu(struct scull_stats);
+		if (!scull_p_devices[i].stats) {
+			while (i--) {
+				free_percpu(scull_p_devices[i].stats);
+			}
+			kfree(scull_p_devices);
+			scull_p_devices = NULL;
+			unregister_chrdev_region(firstdev, scull_p_nr_devs);
+			return 0;
+		}
+	}
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		init_waitqueue_head(&(scull_p_devices[i].inq));
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		sema_init(&scull_p_devices[i].sem, 1);
+		sema_init(&scull_p_devices[i].rsem, 1);
+		sema_init(&scull_p_devices[i].wsem, 1);
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 
@@ -330,47 +1273,439 @@ int scull_p_init(dev_t firstdev) {
 	return scull_p_nr_devs;
 }
 
-// This is called by cleanup_module or on failure.
-// It is required to never fail, even if nothing was initialized first
-void scull_p_cleanup(void) {
-	int i;
+// This is called by cleanup_module or on failure.
+// It is required to never fail, even if nothing was initialized first
+void scull_p_cleanup(void) {
+	int i;
+
+	if (!scull_p_devices) {
+		return;	// Nothing else to release
+	}
+
+	for (i = 0; i < scull_p_nr_devs; i++) {
+		cdev_del(&scull_p_devices[i].cdev);
+		vfree(scull_p_devices[i].buffer);
+		if (scull_p_devices[i].ring.queue) {
+			ptr_ring_cleanup(&scull_p_devices[i].ring, scull_p_free_rec);
+		}
+		free_percpu(scull_p_devices[i].stats);
+	}
+	kfree(scull_p_devices);
+	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
+	scull_p_devices = NULL;
+}
+
+void scull_cleanup_module(void);
+
+// Find (or create) the quantum cache for a given object size. Caches
+// are never destroyed before module unload, so a device can keep the
+// pointer for as long as it keeps that quantum size.
+static struct kmem_cache *scull_get_qcache(int size) {
+	struct scull_qcache *qc;
+	struct kmem_cache *cache = NULL;
+
+	mutex_lock(&scull_qcache_lock);
+	list_for_each_entry(qc, &scull_qcaches, list) {
+		if (qc->size == size) {
+			cache = qc->cache;
+			goto out;
+		}
+	}
+
+	qc = kmalloc(sizeof(struct scull_qcache), GFP_KERNEL);
+	if (!qc) {
+		goto out;
+	}
+	qc->size = size;
+	snprintf(qc->name, sizeof(qc->name), "scull_q%d", size);
+	qc->cache = kmem_cache_create(qc->name, size, 0, 0, NULL);
+	if (!qc->cache) {
+		kfree(qc);
+		goto out;
+	}
+	list_add(&qc->list, &scull_qcaches);
+	cache = qc->cache;
+out:
+	mutex_unlock(&scull_qcache_lock);
+	return cache;
+}
+
+static void scull_destroy_qcaches(void) {
+	struct scull_qcache *qc, *tmp;
+
+	list_for_each_entry_safe(qc, tmp, &scull_qcaches, list) {
+		list_del(&qc->list);
+		kmem_cache_destroy(qc->cache);
+		kfree(qc);
+	}
+}
+
+// Page mode needs a quantum the page allocator can hand out exactly
+static int scull_pages_ok(int quantum) {
+	return quantum >= PAGE_SIZE && is_power_of_2(quantum);
+}
+
+// Pick the node for the next quantum. Caller must hold dev->sem for
+// writing, as interleaving moves dev->next_node.
+static int scull_quantum_node(struct scull_dev *dev) {
+	switch (dev->numa) {
+	case SCULL_NUMA_LOCAL:
+		return numa_node_id();
+	case SCULL_NUMA_INTERLEAVE:
+		dev->next_node = next_node_in(dev->next_node, node_states[N_MEMORY]);
+		return dev->next_node;
+	default:
+		return NUMA_NO_NODE;
+	}
+}
+
+// Charge (n = 1) or refund (n = -1) a quantum of bytes to dev. The
+// node we asked for is only a preference: count where it landed.
+static void scull_account(struct scull_dev *dev, void *p, long bytes, int n) {
+	atomic_long_add(n, &dev->nquanta);
+	atomic_long_add(n * bytes, &dev->qbytes);
+	atomic_long_add(n * bytes, &dev->node_bytes[page_to_nid(virt_to_page(p))]);
+}
+
+// What an object of size bytes really costs in a slab: its share of
+// the slab, tail waste included. The order is the smallest that wastes
+// at most 1/16th of the slab, as SLUB picks it.
+static long scull_slab_cost(unsigned int size) {
+	unsigned int order;
+
+	for (order = get_order(size); order < PAGE_ALLOC_COSTLY_ORDER; order++) {
+		if ((PAGE_SIZE << order) % size <= (PAGE_SIZE << order) / 16) {
+			break;
+		}
+	}
+	return DIV_ROUND_UP(PAGE_SIZE << order, (PAGE_SIZE << order) / size);
+}
+
+// What a quantum allocated with the given mode really takes
+static long scull_quantum_bytes(int alloc, struct kmem_cache *qcache,
+		int quantum, void *p) {
+	switch (alloc) {
+	case SCULL_ALLOC_CACHE:
+		return scull_slab_cost(kmem_cache_size(qcache));
+	case SCULL_ALLOC_PAGES:
+		return PAGE_SIZE << get_order(quantum);
+	default:
+		return ksize(p);
+	}
+}
+
+// Allocate one quantum with the allocator selected for the device.
+// Zeroed: a partial write must not leave old kernel data readable,
+// and holes have to read back as zeros.
+void *scull_alloc_quantum(struct scull_dev *dev) {
+	int node = scull_quantum_node(dev);
+	struct page *page;
+	void *p;
+
+	switch (dev->alloc) {
+	case SCULL_ALLOC_CACHE:
+		if (!dev->qcache) {
+			dev->qcache = scull_get_qcache(dev->quantum);
+			if (!dev->qcache) {
+				return NULL;
+			}
+		}
+		p = kmem_cache_alloc_node(dev->qcache, GFP_KERNEL | __GFP_ZERO, node);
+		break;
+	case SCULL_ALLOC_PAGES:
+		// compound, so that splice can hold a reference on any page of it
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP | __GFP_ZERO,
+				get_order(dev->quantum));
+		p = page ? page_address(page) : NULL;
+		break;
+	default:
+		p = kmalloc_node(dev->quantum, GFP_KERNEL | __GFP_ZERO, node);
+		break;
+	}
+	if (!p) {
+		return NULL;
+	}
+
+	scull_account(dev, p, scull_quantum_bytes(dev->alloc, dev->qcache,
+				dev->quantum, p), 1);
+	return p;
+}
+
+// Free a quantum allocated with the given mode, cache and quantum size
+static void __scull_free_quantum(struct scull_dev *dev, int alloc,
+		struct kmem_cache *qcache, int quantum, void *p) {
+	if (!p) {
+		return;
+	}
+
+	scull_account(dev, p, scull_quantum_bytes(alloc, qcache, quantum, p), -1);
+	switch (alloc) {
+	case SCULL_ALLOC_CACHE:
+		kmem_cache_free(qcache, p);
+		break;
+	case SCULL_ALLOC_PAGES:
+		free_pages((unsigned long)p, get_order(quantum));
+		break;
+	default:
+		kfree(p);
+		break;
+	}
+}
+
+void scull_free_quantum(struct scull_dev *dev, void *p) {
+	__scull_free_quantum(dev, dev->alloc, dev->qcache, dev->quantum, p);
+}
+
+#ifdef SCULL_COMPRESS
+static inline int scull_is_zq(void *slot) {
+	return ((unsigned long)slot & (SCULL_SHARED | SCULL_ZQ)) == SCULL_ZQ;
+}
+
+static inline struct scull_zq *scull_to_zq(void *slot) {
+	return (struct scull_zq *)((unsigned long)slot & ~SCULL_ZQ);
+}
+
+// Note an access to a quantum, for the compactor. It may be giving
+// the qset its access times under the read lock.
+static inline void scull_touch(struct scull_qset *dptr, int s_pos) {
+	unsigned long *atime = READ_ONCE(dptr->atime);
+
+	if (atime) {
+		WRITE_ONCE(atime[s_pos], jiffies);
+	}
+}
+
+static void __scull_free_zq(struct scull_zq *zq) {
+	zs_free(scull_zpool, zq->handle);
+	kfree(zq);
+}
+
+static void scull_free_zq(struct scull_dev *dev, struct scull_zq *zq) {
+	atomic_long_dec(&dev->nzq);
+	atomic_long_sub(zq->len, &dev->zbytes);
+	atomic_long_sub(zq->quantum, &dev->zorig);
+	__scull_free_zq(zq);
+}
+
+// Compress the quantum q into the pool, using wrk and the buffer buf
+// of size bytes. Return the compressed copy, NULL if it does not
+// compress well enough. The quantum is left alone: the caller needs
+// only the read lock.
+static struct scull_zq *scull_deflate(struct scull_dev *dev, void *q, void *wrk,
+		char *buf, int size) {
+	struct scull_zq *zq;
+	void *dst;
+	int len;
+
+	len = LZ4_compress_default(q, buf, dev->quantum, size, wrk);
+	// not worth a slot in the pool unless it saves a quarter
+	if (len <= 0 || len > dev->quantum - dev->quantum / 4) {
+		return NULL;
+	}
+	zq = kmalloc(sizeof(*zq), GFP_KERNEL);
+	if (!zq) {
+		return ERR_PTR(-ENOMEM);
+	}
+	zq->handle = zs_malloc(scull_zpool, len, GFP_KERNEL | __GFP_NOWARN);
+	if (!zq->handle) {
+		kfree(zq);
+		return ERR_PTR(-ENOMEM);
+	}
+	zq->len = len;
+	zq->quantum = dev->quantum;
+	dst = zs_map_object(scull_zpool, zq->handle, ZS_MM_WO);
+	memcpy(dst, buf, len);
+	zs_unmap_object(scull_zpool, zq->handle);
+	return zq;
+}
+
+// Bring a compressed quantum back. Caller must hold dev->sem for writing.
+static void *scull_inflate(struct scull_dev *dev, void **slot) {
+	struct scull_zq *zq = scull_to_zq(*slot);
+	void *p, *src;
+	int len;
+
+	p = scull_alloc_quantum(dev);
+	if (!p) {
+		return NULL;
+	}
+	src = zs_map_object(scull_zpool, zq->handle, ZS_MM_RO);
+	len = LZ4_decompress_safe(src, p, zq->len, dev->quantum);
+	zs_unmap_object(scull_zpool, zq->handle);
+	WARN_ON_ONCE(len != dev->quantum);
+
+	scull_free_zq(dev, zq);
+	atomic_long_inc(&dev->zfaults);
+	*slot = p;
+	return p;
+}
+#else
+static inline int scull_is_zq(void *slot) {
+	return 0;
+}
+
+static inline struct scull_zq *scull_to_zq(void *slot) {
+	return NULL;
+}
+
+static inline void scull_touch(struct scull_qset *dptr, int s_pos) {
+}
+
+static void scull_free_zq(struct scull_dev *dev, struct scull_zq *zq) {
+}
+
+static void *scull_inflate(struct scull_dev *dev, void **slot) {
+	return NULL;
+}
+#endif
+
+/*
+ * Slots of a qset hold either a quantum of their own, a tagged pointer
+ * to a struct scull_shared or one to a struct scull_zq.
+ */
+static inline int scull_is_shared(void *slot) {
+	return (unsigned long)slot & SCULL_SHARED;
+}
+
+static inline struct scull_shared *scull_to_shared(void *slot) {
+	return (struct scull_shared *)((unsigned long)slot & ~SCULL_SHARED);
+}
+
+// Take a reference on sh for a slot
+static inline void *scull_shared_slot(struct scull_shared *sh) {
+	refcount_inc(&sh->ref);
+	return (void *)((unsigned long)sh | SCULL_SHARED);
+}
+
+// The data a slot reads from; NULL reads as zeros
+static inline void *scull_slot_data(void *slot) {
+	return scull_is_shared(slot) ? scull_to_shared(slot)->data : slot;
+}
+
+static void scull_put_shared(struct scull_shared *sh) {
+	if (refcount_dec_and_test(&sh->ref)) {
+		__scull_free_quantum(sh->owner, sh->alloc, sh->qcache,
+				sh->quantum, sh->data);
+		kfree(sh);
+	}
+}
+
+// Drop a slot, whatever it holds
+static void __scull_free_slot(struct scull_dev *dev, int alloc,
+		struct kmem_cache *qcache, int quantum, void *slot) {
+	if (scull_is_shared(slot)) {
+		scull_put_shared(scull_to_shared(slot));
+	} else if (scull_is_zq(slot)) {
+		scull_free_zq(dev, scull_to_zq(slot));
+	} else {
+		__scull_free_quantum(dev, alloc, qcache, quantum, slot);
+	}
+}
+
+static void scull_free_slot(struct scull_dev *dev, void *slot) {
+	__scull_free_slot(dev, dev->alloc, dev->qcache, dev->quantum, slot);
+}
+
+// Make the quantum of a slot dev's own before writing to it: allocate
+// one for a hole, copy a shared one, or take it over from its last
+// user. Caller must hold dev->sem for writing.
+static void *scull_slot_writable(struct scull_dev *dev, void **slot) {
+	struct scull_shared *sh;
+	void *p;
+
+	if (!*slot) {
+		*slot = scull_alloc_quantum(dev);
+		return *slot;
+	}
+	if (scull_is_zq(*slot)) {
+		return scull_inflate(dev, slot);
+	}
+	if (!scull_is_shared(*slot)) {
+		return *slot;
+	}
+
+	sh = scull_to_shared(*slot);
+	if (sh->data && refcount_read(&sh->ref) == 1) {
+		// Nobody else can get a reference: it is only reachable
+		// through this slot, under our lock
+		p = sh->data;
+		if (sh->owner != dev) {
+			long bytes = scull_quantum_bytes(sh->alloc, sh->qcache,
+					sh->quantum, p);
+
+			scull_account(sh->owner, p, bytes, -1);
+			scull_account(dev, p, bytes, 1);
+		}
+		kfree(sh);
+		*slot = p;
+		return p;
+	}
+
+	p = scull_alloc_quantum(dev);
+	if (!p) {
+		return NULL;
+	}
+	if (sh->data) {
+		memcpy(p, sh->data, dev->quantum);
+	}
+	scull_put_shared(sh);
+	*slot = p;
+	return p;
+}
+
+// Turn a quantum of dev into a shared one, with no reference taken yet
+// for other slots
+static struct scull_shared *scull_share(struct scull_dev *dev, void *p) {
+	struct scull_shared *sh = kmalloc(sizeof(*sh), GFP_KERNEL);
+
+	if (sh) {
+		refcount_set(&sh->ref, 1);
+		sh->data = p;
+		sh->alloc = dev->alloc;
+		sh->qcache = dev->qcache;
+		sh->quantum = dev->quantum;
+		sh->owner = dev;
+	}
+	return sh;
+}
+
+// Allocate a piece of the qset index, keeping track of what it costs
+static void *scull_alloc_index(struct scull_dev *dev, size_t size) {
+	void *p = kmalloc(size, GFP_KERNEL);
 
-	if (!scull_p_devices) {
-		return;	// Nothing else to release
+	if (p) {
+		memset(p, 0, size);
+		atomic_long_add(ksize(p), &dev->ibytes);
 	}
+	return p;
+}
 
-	for (i = 0; i < scull_p_nr_devs; i++) {
-		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+static void scull_free_index(struct scull_dev *dev, void *p) {
+	if (p) {
+		atomic_long_sub(ksize(p), &dev->ibytes);
+		kfree(p);
 	}
-	kfree(scull_p_devices);
-	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
-	scull_p_devices = NULL;
 }
 
-void scull_cleanup_module(void);
-
 // Follow the list
 struct scull_qset *scull_follow(struct scull_dev *dev, int n) {
 	struct scull_qset *qs = dev->data;
 
 	// Allocate first qset explicitly if need be
 	if (!qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+		qs = dev->data = scull_alloc_index(dev, sizeof(struct scull_qset));
 		if (qs == NULL) {
 			return NULL;
 		}
-		memset(qs, 0, sizeof(struct scull_qset));
 	}
 
 	// The follow the list
 	while(n--) {
 		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+			qs->next = scull_alloc_index(dev, sizeof(struct scull_qset));
 			if (qs->next == NULL) {
 				return NULL;
 			}
-			memset(qs->next, 0, sizeof(struct scull_qset));
 		}
 		qs = qs->next;
 	}
@@ -378,27 +1713,310 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n) {
 	return qs;
 }
 
-// Empty out the scull device
-int scull_trim(struct scull_dev *dev) {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;	/* "dev" is not-null */
-	int i;
+// Follow the list without allocating anything: NULL if it is shorter
+struct scull_qset *scull_lookup(struct scull_dev *dev, int n) {
+	struct scull_qset *qs = dev->data;
+
+	while (qs && n--) {
+		qs = qs->next;
+	}
+	return qs;
+}
+
+// Free up to *budget quanta of a dead tree (all of them if *budget is
+// negative). Return 1 once the whole tree is gone.
+static int scull_free_dead(struct scull_dev *dev, struct scull_dead *dead,
+		long *budget) {
+	struct scull_qset *dptr;
+	void *p;
 
-	for (dptr = dev->data; dptr; dptr = next) {
+	while ((dptr = dead->data)) {
 		if (dptr->data) {
-			for (i = 0; i < qset; i++) {
-				kfree(dptr->data[i]);
+			while (dead->pos < dead->qset) {
+				if (*budget == 0) {
+					return 0;
+				}
+				p = dptr->data[dead->pos++];
+				if (p) {
+					__scull_free_slot(dev, dead->alloc,
+						dead->qcache, dead->quantum, p);
+					(*budget)--;
+				}
+			}
+			scull_free_index(dev, dptr->data);
+		}
+		scull_free_index(dev, dptr->atime);
+		dead->data = dptr->next;
+		dead->pos = 0;
+		scull_free_index(dev, dptr);
+	}
+	return 1;
+}
+
+// Background half of the trim: free the dead trees in batches of
+// scull_trim_batch quanta, one batch per jiffy
+static void scull_trim_work(struct work_struct *work) {
+	struct scull_dev *dev = container_of(to_delayed_work(work),
+			struct scull_dev, trim_work);
+	struct scull_dead *dead;
+	long budget = scull_trim_batch > 0 ? scull_trim_batch : 1;
+
+	spin_lock(&dev->dead_lock);
+	while (!list_empty(&dev->dead)) {
+		dead = list_first_entry(&dev->dead, struct scull_dead, list);
+		spin_unlock(&dev->dead_lock);
+
+		// Only this work removes entries, so dead stays valid
+		if (!scull_free_dead(dev, dead, &budget)) {
+			queue_delayed_work(scull_trim_wq, &dev->trim_work, 1);
+			return;
+		}
+
+		spin_lock(&dev->dead_lock);
+		list_del(&dead->list);
+		kfree(dead);
+		cond_resched_lock(&dev->dead_lock);
+	}
+	spin_unlock(&dev->dead_lock);
+}
+
+#ifdef SCULL_COMPRESS
+// Quanta the compactor looks at, and compresses at most, per pass
+#define SCULL_COMPACT_BATCH 1024
+#define SCULL_COMPACT_SWAP 32
+
+// A quantum the compactor compressed, and where it found it
+struct scull_compact {
+	long item;
+	int i;
+	void *q;		// the quantum
+	unsigned long stamp;	// its access time then
+	struct scull_zq *zq;	// the compressed copy
+};
+
+// Put a compressed copy in place of its quantum, unless the slot
+// changed since: writers touch the access time, so a quantum written
+// to after it was compressed no longer has the same one. Caller must
+// hold dev->sem for writing.
+static void scull_swap_zq(struct scull_dev *dev, struct scull_compact *c) {
+	struct scull_qset *dptr = scull_lookup(dev, c->item);
+	struct scull_zq *zq = c->zq;
+
+	if (!dptr || !dptr->data || !dptr->atime || c->i >= dev->qset ||
+			zq->quantum != dev->quantum || dptr->data[c->i] != c->q ||
+			dptr->atime[c->i] != c->stamp) {
+		__scull_free_zq(zq);
+		return;
+	}
+	scull_free_quantum(dev, c->q);
+	dptr->data[c->i] = (void *)((unsigned long)zq | SCULL_ZQ);
+	atomic_long_inc(&dev->nzq);
+	atomic_long_add(zq->quantum, &dev->zorig);
+	atomic_long_add(zq->len, &dev->zbytes);
+}
+
+// Compress the quanta not accessed for scull_compress_ms, and come
+// back one interval later. Each pass compresses a batch under the
+// read lock, so only writers wait for LZ4, and then swaps the copies
+// in under the write lock. A qset seen for the first time only gets
+// its access times started.
+static void scull_compact_work(struct work_struct *work) {
+	struct scull_dev *dev = container_of(to_delayed_work(work),
+			struct scull_dev, compact_work);
+	unsigned long idle = msecs_to_jiffies(scull_compress_ms);
+	struct scull_compact *cand = NULL;
+	struct scull_qset *dptr;
+	struct scull_zq *zq;
+	unsigned long *atime, stamp;
+	long item = 0, faults;
+	int i = 0, j, n, nc, qset, size, bufsize = 0;
+	char *buf = NULL;
+	void *wrk, *p;
+
+	wrk = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+	cand = kmalloc_array(SCULL_COMPACT_SWAP, sizeof(*cand), GFP_KERNEL);
+	if (!wrk || !cand) {
+		goto out;
+	}
+
+	do {
+		down_read(&dev->sem);
+		qset = dev->qset;
+		size = LZ4_compressBound(dev->quantum);
+		if (size > bufsize) {
+			kvfree(buf);
+			buf = kvmalloc(size, GFP_KERNEL);
+			bufsize = buf ? size : 0;
+			if (!buf) {
+				up_read(&dev->sem);
+				goto out;
+			}
+		}
+
+		dptr = scull_lookup(dev, item);
+		if (i >= qset) {
+			// trimmed and given a smaller qset while unlocked
+			i = 0;
+		}
+		nc = 0;
+		for (n = 0; dptr && n < SCULL_COMPACT_BATCH && nc < SCULL_COMPACT_SWAP; n++) {
+			if (dptr->data && !dptr->atime) {
+				atime = scull_alloc_index(dev, qset * sizeof(unsigned long));
+				for (j = 0; atime && j < qset; j++) {
+					atime[j] = jiffies;
+				}
+				// readers may be in scull_touch() already
+				smp_store_release(&dptr->atime, atime);
+				i = qset;
+			}
+			if (!dptr->data || !dptr->atime) {
+				i = qset;
+			} else {
+				p = dptr->data[i];
+				stamp = READ_ONCE(dptr->atime[i]);
+				if (p && !scull_is_shared(p) && !scull_is_zq(p) &&
+						time_after(jiffies, stamp + idle)) {
+					zq = scull_deflate(dev, p, wrk, buf, bufsize);
+					if (IS_ERR(zq)) {
+						dptr = NULL;	// out of memory: try again next time
+						break;
+					}
+					if (zq) {
+						cand[nc++] = (struct scull_compact){ item, i, p, stamp, zq };
+					}
+				}
+				i++;
+			}
+			if (i >= qset) {
+				i = 0;
+				item++;
+				dptr = dptr->next;
+			}
+		}
+		up_read(&dev->sem);
+
+		if (nc) {
+			down_write(&dev->sem);
+			for (j = 0; j < nc; j++) {
+				scull_swap_zq(dev, &cand[j]);
 			}
-			kfree(dptr->data);
-			dptr->data = NULL;
+			up_write(&dev->sem);
 		}
-		next = dptr->next;
-		kfree(dptr);
+		cond_resched();
+	} while (dptr);
+
+	faults = atomic_long_read(&dev->zfaults);
+	if (time_after(jiffies, dev->zlast)) {
+		dev->zfault_rate = (faults - dev->zfaults_last) * HZ /
+			(long)(jiffies - dev->zlast);
 	}
+	dev->zfaults_last = faults;
+	dev->zlast = jiffies;
+out:
+	kfree(cand);
+	kvfree(buf);
+	kvfree(wrk);
+	queue_delayed_work(scull_trim_wq, &dev->compact_work, idle);
+}
+#endif
+
+// Unhook the quantum tree, leaving an empty device with the same
+// geometry. Caller must hold dev->sem for writing.
+static void scull_detach(struct scull_dev *dev, struct scull_dead *dead) {
+	dead->data = dev->data;
+	dead->pos = 0;
+	dead->quantum = dev->quantum;
+	dead->qset = dev->qset;
+	dead->alloc = dev->alloc;
+	dead->qcache = dev->qcache;
+
 	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
 	dev->data = NULL;
+}
+
+// Change the quantum, qset or allocator of a device (0, 0 and -1 keep
+// the current value). Only an empty device may change: the quanta it
+// holds could not be found or freed any more otherwise.
+int scull_configure(struct scull_dev *dev, int quantum, int qset, int alloc) {
+	int retval = 0;
+
+	if (down_write_killable(&dev->sem)) {
+		return -ERESTARTSYS;
+	}
+	quantum = quantum ? quantum : dev->quantum;
+	qset = qset ? qset : dev->qset;
+	alloc = alloc >= 0 ? alloc : dev->alloc;
+
+	if (quantum < 0 || qset < 0 || alloc >= SCULL_ALLOC_NR ||
+			(long)quantum * qset > INT_MAX) {
+		retval = -EINVAL;
+		goto out;
+	}
+	if (alloc == SCULL_ALLOC_PAGES && !scull_pages_ok(quantum)) {
+		retval = -EINVAL;
+		goto out;
+	}
+	if (dev->data || dev->blk_openers) {
+		retval = -EBUSY;
+		goto out;
+	}
+
+	if (quantum != dev->quantum) {
+		dev->qcache = NULL;	// looked up again on next use
+	}
+	dev->quantum = quantum;
+	dev->qset = qset;
+	dev->alloc = alloc;
+out:
+	up_write(&dev->sem);
+	return retval;
+}
+
+// Empty out the scull device, right now. Used when nobody else can
+// touch the device any more; the trim work must not be running.
+int scull_trim(struct scull_dev *dev) {
+	struct scull_dead dead, *d, *tmp;
+	long budget = -1;
+
+	list_for_each_entry_safe(d, tmp, &dev->dead, list) {
+		scull_free_dead(dev, d, &budget);
+		list_del(&d->list);
+		kfree(d);
+	}
+
+	scull_detach(dev, &dead);
+	scull_free_dead(dev, &dead, &budget);
+	return 0;
+}
+
+// Empty out the scull device in O(1): the old tree is handed over to
+// the trim work. Caller must hold dev->sem for writing.
+int scull_trim_deferred(struct scull_dev *dev) {
+	struct scull_dead *dead;
+
+	if (!dev->data) {
+		struct scull_dead empty;
+
+		scull_detach(dev, &empty);
+		return 0;
+	}
+
+	dead = kmalloc(sizeof(struct scull_dead), GFP_KERNEL);
+	if (!dead) {
+		// No memory to defer: free inline, it is slower but safe
+		long budget = -1;
+		struct scull_dead now;
+
+		scull_detach(dev, &now);
+		scull_free_dead(dev, &now, &budget);
+		return 0;
+	}
+
+	scull_detach(dev, dead);
+	spin_lock(&dev->dead_lock);
+	list_add_tail(&dead->list, &dev->dead);
+	spin_unlock(&dev->dead_lock);
+	queue_delayed_work(scull_trim_wq, &dev->trim_work, 0);
 	return 0;
 }
 
@@ -408,13 +2026,25 @@ int scull_open(struct inode *inode, struct file *flip) {
 	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
 	flip->private_data = dev;
 
-	// Now trim to 0 the length of the devices if open was right only
+	// Now trim to 0 the length of the devices if open was right only.
+	// The quanta are freed later by the trim work, so this takes the
+	// same time whatever the size of the device. Not while the disk
+	// is open: the data is what /dev/scullbN holds.
 	if ( (flip->f_flags & O_ACCMODE) == O_WRONLY) {
-		scull_trim(dev);
+		if (down_write_killable(&dev->sem)) {
+			return -ERESTARTSYS;
+		}
+		if (dev->blk_openers) {
+			up_write(&dev->sem);
+			return -EBUSY;
+		}
+		scull_trim_deferred(dev);
+		up_write(&dev->sem);
 	}
 
 	printk("scull: open successfully\n");
 
+	flip->f_mode |= FMODE_NOWAIT;	// read_iter/write_iter honor IOCB_NOWAIT
 	return 0;
 }
 
@@ -422,15 +2052,67 @@ int scull_release(struct inode *inode, struct file *flip) {
 	return 0;
 }
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-		loff_t *f_pos) {
-	struct scull_dev *dev = filp->private_data;
+// Take the device lock for read_iter/write_iter: IOCB_NOWAIT callers
+// get -EAGAIN instead of sleeping on it. iocb is NULL for the block
+// device and splice, which always wait.
+static int scull_lock(struct scull_dev *dev, struct kiocb *iocb, int write) {
+	if (iocb && (iocb->ki_flags & IOCB_NOWAIT)) {
+		if (write ? down_write_trylock(&dev->sem) : down_read_trylock(&dev->sem)) {
+			return 0;
+		}
+		return -EAGAIN;
+	}
+	if (write ? down_write_killable(&dev->sem) : down_read_killable(&dev->sem)) {
+		return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+// A reader met a compressed quantum at pos: bring it back under the
+// write lock
+static int scull_inflate_at(struct scull_dev *dev, struct kiocb *iocb, loff_t pos) {
+	struct scull_qset *dptr;
+	void **slot;
+	long itemsize;
+	int retval;
+
+	retval = scull_lock(dev, iocb, 1);
+	if (retval) {
+		return retval;
+	}
+	itemsize = (long)dev->quantum * dev->qset;
+	dptr = scull_lookup(dev, pos / itemsize);
+	if (dptr && dptr->data) {
+		slot = &dptr->data[(pos % itemsize) / dev->quantum];
+		if (scull_is_zq(*slot) && !scull_inflate(dev, slot)) {
+			retval = -ENOMEM;
+		}
+	}
+	up_write(&dev->sem);
+	return retval;
+}
+
+// Read from the quantum at *f_pos, up to its end, into to. Shared by
+// read_iter and the block device.
+static ssize_t scull_do_read(struct scull_dev *dev, struct kiocb *iocb,
+		loff_t *f_pos, struct iov_iter *to) {
+	size_t count = iov_iter_count(to);
 	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
+	int quantum, qset;
+	int itemsize;
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = 0;
-	
+	void *q;
+
+again:
+	retval = scull_lock(dev, iocb, 0);
+	if (retval) {
+		return retval;
+	}
+	// The geometry only changes under the write lock
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
 	if (*f_pos >= dev->size) {
 		goto out;
 	}
@@ -438,90 +2120,559 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
 		count = dev->size - *f_pos;
 	}
 
-	// find listitem, qset index, and offset in the quantum
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+	// find listitem, qset index, and offset in the quantum
+	item = (long)*f_pos / itemsize;
+	rest = (long)*f_pos % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+
+	// follow the list up to the right position
+	dptr = scull_lookup(dev, item);
+
+	// read only up to the end of this quantum
+	if (count > quantum - q_pos) {
+		count = quantum - q_pos;
+	}
+
+	if (dptr && dptr->data && scull_is_zq(dptr->data[s_pos])) {
+		// compressed: it is brought back under the write lock, then
+		// the read starts over
+		up_read(&dev->sem);
+		retval = scull_inflate_at(dev, iocb, *f_pos);
+		if (retval) {
+			return retval;
+		}
+		goto again;
+	}
+	if (dptr && dptr->data) {
+		scull_touch(dptr, s_pos);
+	}
+	q = dptr && dptr->data ? scull_slot_data(dptr->data[s_pos]) : NULL;
+	if (!q) {
+		// a hole or the zero quantum: it reads as zeros
+		if (iov_iter_zero(count, to) != count) {
+			retval = -EFAULT;
+			goto out;
+		}
+	} else if (copy_to_iter(q + q_pos, count, to) != count) {
+		retval = -EFAULT;
+		goto out;
+	}
+	*f_pos += count;
+	retval = count;
+
+	this_cpu_inc(dev->stats->reads);
+	this_cpu_add(dev->stats->read_bytes, count);
+out:
+	up_read(&dev->sem);
+	trace_scull_read(dev->cdev.dev, *f_pos - (retval > 0 ? retval : 0),
+			count, retval);
+	return retval;
+}
+
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	return scull_do_read(iocb->ki_filp->private_data, iocb, &iocb->ki_pos, to);
+}
+
+// A write left the quantum q at item, s_pos all zeros: trade it for
+// the zero quantum, unless the slot changed once we let go of it
+static void scull_zero_swap(struct scull_dev *dev, struct kiocb *iocb,
+		long item, int s_pos, void *q) {
+	struct scull_qset *dptr;
+
+	if (scull_lock(dev, iocb, 1)) {
+		return;		// it only saves memory
+	}
+	dptr = scull_lookup(dev, item);
+	if (dptr && dptr->data && s_pos < dev->qset && dptr->data[s_pos] == q &&
+			!memchr_inv(q, 0, dev->quantum)) {
+		scull_free_quantum(dev, q);
+		dptr->data[s_pos] = scull_shared_slot(&scull_zero);
+	}
+	up_write(&dev->sem);
+}
+
+// Write into a quantum that is dev's own already. That changes no
+// pointer, so it only takes the read lock and writers run side by
+// side, as the block device's queues do on every CPU. Returns 0,
+// having done nothing, when the write needs the write lock: a hole or
+// a qset index to allocate, a shared or compressed quantum to copy.
+static ssize_t scull_write_inplace(struct scull_dev *dev, struct kiocb *iocb,
+		loff_t *f_pos, struct iov_iter *from) {
+	size_t count = iov_iter_count(from);
+	struct scull_qset *dptr;
+	long quantum, itemsize, item, rest;
+	unsigned long size, old;
+	int s_pos, q_pos, zero = 0;
+	ssize_t retval;
+	void *q;
+
+	retval = scull_lock(dev, iocb, 0);
+	if (retval) {
+		return retval;
+	}
+	quantum = dev->quantum;
+	itemsize = quantum * dev->qset;
+	item = (long)*f_pos / itemsize;
+	rest = (long)*f_pos % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+
+	dptr = scull_lookup(dev, item);
+	q = dptr && dptr->data ? dptr->data[s_pos] : NULL;
+	if (!q || ((unsigned long)q & (SCULL_SHARED | SCULL_ZQ))) {
+		up_read(&dev->sem);
+		return 0;
+	}
+	if (count > quantum - q_pos) {
+		count = quantum - q_pos;
+	}
+
+	if (copy_from_iter(q + q_pos, count, from) != count) {
+		retval = -EFAULT;
+		goto out;
+	}
+	// After the copy: the compactor, also under the read lock, tells
+	// from the access time whether the quantum changed while it was
+	// compressing it
+	scull_touch(dptr, s_pos);
+	zero = q_pos + count == quantum && !memchr_inv(q, 0, quantum);
+
+	*f_pos += count;
+	retval = count;
+
+	// Update the size, which other writers may be growing too
+	size = READ_ONCE(dev->size);
+	while (size < *f_pos) {
+		old = cmpxchg(&dev->size, size, (unsigned long)*f_pos);
+		if (old == size) {
+			break;
+		}
+		size = old;
+	}
+
+	this_cpu_inc(dev->stats->writes);
+	this_cpu_add(dev->stats->write_bytes, count);
+out:
+	up_read(&dev->sem);
+	if (zero) {
+		scull_zero_swap(dev, iocb, item, s_pos, q);
+	}
+	trace_scull_write(dev->cdev.dev, *f_pos - (retval > 0 ? retval : 0),
+			count, retval);
+	return retval;
+}
+
+// Write from from into the quantum at *f_pos, up to its end
+static ssize_t scull_do_write(struct scull_dev *dev, struct kiocb *iocb,
+		loff_t *f_pos, struct iov_iter *from) {
+	size_t count = iov_iter_count(from);
+	struct scull_qset *dptr;
+	int quantum, qset;
+	int itemsize;
+	int item, s_pos, q_pos, rest;
+	ssize_t retval;
+	void *q;
+
+	retval = scull_write_inplace(dev, iocb, f_pos, from);
+	if (retval) {
+		return retval;
+	}
+	retval = scull_lock(dev, iocb, 1);
+	if (retval) {
+		return retval;
+	}
+	retval = -ENOMEM;
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
+
+	item = (long)*f_pos / itemsize;
+	rest = (long)*f_pos % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+
+	dptr = scull_follow(dev, item);
+	if (dptr == NULL) {
+		goto out;
+	}
+	if (!dptr->data) {
+		dptr->data = scull_alloc_index(dev, qset * sizeof(char *));
+		if (!dptr->data) {
+			goto out;
+		}
+	}
+	q = scull_slot_writable(dev, &dptr->data[s_pos]);
+	if (!q) {
+		goto out;
+	}
+	scull_touch(dptr, s_pos);
+	// Write only up to the end of this quantum
+	if (count > quantum - q_pos) {
+		count = quantum - q_pos;
+	}
+
+	if (copy_from_iter(q + q_pos, count, from) != count) {
+		retval = -EFAULT;
+		goto out;
+	}
+	// A quantum that ends up all zeros is traded for the zero quantum.
+	// Only checked when the write reaches its end, so a quantum filled
+	// sequentially is scanned once.
+	if (q_pos + count == quantum && !memchr_inv(q, 0, quantum)) {
+		scull_free_quantum(dev, q);
+		dptr->data[s_pos] = scull_shared_slot(&scull_zero);
+	}
+
+	*f_pos += count;
+	retval = count;
+
+	// Update the size
+	if (dev->size < *f_pos) {
+		dev->size = *f_pos;
+	}
+
+	this_cpu_inc(dev->stats->writes);
+	this_cpu_add(dev->stats->write_bytes, count);
+out:
+	up_write(&dev->sem);
+	trace_scull_write(dev->cdev.dev, *f_pos - (retval > 0 ? retval : 0),
+			count, retval);
+	return retval;
+}
+
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	return scull_do_write(iocb->ki_filp->private_data, iocb, &iocb->ki_pos, from);
+}
+
+// Move device data into a pipe without going through user space.
+// Page-mode quanta are handed to the pipe by reference and holes as the
+// zero page; quanta from the slab are copied into fresh pages.
+ssize_t scull_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+	struct scull_dev *dev = filp->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+		.ops		= &scull_pipe_buf_ops,
+		.spd_release	= scull_spd_release,
+	};
+	struct scull_qset *dptr;
+	loff_t pos = *ppos;
+	unsigned int space;
+	long quantum, qset;
+	size_t chunk;
+	ssize_t ret;
+	void *q;
+
+	space = min(scull_pipe_space(pipe), (unsigned int)PIPE_DEF_BUFFERS);
+	if (!space) {
+		return -EAGAIN;
+	}
+
+again:
+	if (down_read_killable(&dev->sem)) {
+		return -ERESTARTSYS;
+	}
+	quantum = dev->quantum;
+	qset = dev->qset;
+	if (pos >= dev->size) {
+		up_read(&dev->sem);
+		return 0;
+	}
+	len = min(len, (size_t)(dev->size - pos));
+
+	while (len && spd.nr_pages < space) {
+		long item = pos / (quantum * qset);
+		long rest = pos % (quantum * qset);
+		int s_pos = rest / quantum, q_pos = rest % quantum;
+		struct page *page;
+		unsigned int off;
+
+		dptr = scull_lookup(dev, item);
+		if (dptr && dptr->data && scull_is_zq(dptr->data[s_pos])) {
+			// as in scull_read_iter(), after what we have so far
+			if (spd.nr_pages) {
+				break;
+			}
+			up_read(&dev->sem);
+			ret = scull_inflate_at(dev, NULL, pos);
+			if (ret) {
+				return ret;
+			}
+			goto again;
+		}
+		if (dptr && dptr->data) {
+			scull_touch(dptr, s_pos);
+		}
+		q = dptr && dptr->data ? scull_slot_data(dptr->data[s_pos]) : NULL;
+		chunk = min(len, (size_t)(quantum - q_pos));
+
+		if (!q) {
+			page = ZERO_PAGE(0);
+			off = 0;
+			chunk = min(chunk, (size_t)PAGE_SIZE);
+			get_page(page);
+		} else if (dev->alloc == SCULL_ALLOC_PAGES) {
+			page = virt_to_page(q + q_pos);
+			off = offset_in_page(q + q_pos);
+			chunk = min(chunk, (size_t)(PAGE_SIZE - off));
+			get_page(page);
+		} else {
+			page = alloc_page(GFP_KERNEL);
+			if (!page) {
+				break;
+			}
+			off = 0;
+			chunk = min(chunk, (size_t)PAGE_SIZE);
+			memcpy(page_address(page), q + q_pos, chunk);
+		}
+
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = off;
+		partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		pos += chunk;
+		len -= chunk;
+	}
+	up_read(&dev->sem);
+
+	if (!spd.nr_pages) {
+		return -ENOMEM;
+	}
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0) {
+		*ppos += ret;
+	}
+	return ret;
+}
+
+// Where the next data (or hole) starts at or after off. Holes are the
+// quanta never written or punched out, plus the virtual hole at the end.
+// Caller must hold dev->sem.
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t off, int data) {
+	long quantum = dev->quantum, qset = dev->qset;
+	long item = off / (quantum * qset);
+	int s_pos = (off % (quantum * qset)) / quantum;
+	struct scull_qset *dptr;
+	loff_t pos;
+
+	if (off < 0 || off >= dev->size) {
+		return -ENXIO;
+	}
+
+	dptr = scull_lookup(dev, item);
+	pos = (loff_t)item * quantum * qset + (loff_t)s_pos * quantum;
+	while (dptr && pos < dev->size) {
+		if (!dptr->data) {
+			// nothing at all in this qset
+			if (!data) {
+				return max(pos, off);
+			}
+			item++;
+			s_pos = 0;
+			pos = (loff_t)item * quantum * qset;
+			dptr = dptr->next;
+			continue;
+		}
+		if (!!dptr->data[s_pos] == data) {
+			return max(pos, off);
+		}
+		pos += quantum;
+		if (++s_pos == qset) {
+			item++;
+			s_pos = 0;
+			dptr = dptr->next;
+		}
+	}
+
+	// Past the end of the list it is all hole, up to the size
+	if (data) {
+		return -ENXIO;
+	}
+	return min(max(pos, off), (loff_t)dev->size);
+}
 
-	// follow the list up to the right position
-	dptr = scull_follow(dev, item);
+loff_t scull_llseek(struct file *filp, loff_t off, int whence) {
+	struct scull_dev *dev = filp->private_data;
+	loff_t newpos;
 
-	if (dptr == NULL || !dptr->data || !dptr->data[s_pos]) {
-		goto out;
+	if (down_read_killable(&dev->sem)) {
+		return -ERESTARTSYS;
 	}
 
-	// read only up to the end of this quantum
-	if (count > quantum - q_pos) {
-		count = quantum - q_pos;
+	switch (whence) {
+	case SEEK_SET:
+		newpos = off;
+		break;
+	case SEEK_CUR:
+		newpos = filp->f_pos + off;
+		break;
+	case SEEK_END:
+		newpos = dev->size + off;
+		break;
+	case SEEK_DATA:
+		newpos = scull_seek_data(dev, off, 1);
+		break;
+	case SEEK_HOLE:
+		newpos = scull_seek_data(dev, off, 0);
+		break;
+	default: /* can't happen */
+		newpos = -EINVAL;
+		break;
 	}
+	up_read(&dev->sem);
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+	if (newpos < 0) {
+		return newpos == -ENXIO ? -ENXIO : -EINVAL;
 	}
-	*f_pos += count;
-	retval = count;
+	filp->f_pos = newpos;
+	return newpos;
+}
 
-	printk("scull: read successfully\n");
-out:
-	return retval;
+// Release the quanta fully inside [offset, offset + len) and zero the
+// partial ones at the edges. Caller must hold dev->sem for writing.
+int scull_punch_hole(struct scull_dev *dev, loff_t offset, loff_t len) {
+	long quantum = dev->quantum, qset = dev->qset;
+	long item = offset / (quantum * qset);
+	int s_pos = (offset % (quantum * qset)) / quantum;
+	struct scull_qset *dptr = scull_lookup(dev, item);
+	loff_t pos = offset, end = min(offset + len, (loff_t)dev->size);
+	int q_pos, n, i, freed = 0;
+	void *q;
+
+	while (dptr && pos < end) {
+		q_pos = pos % quantum;
+		n = min((loff_t)(quantum - q_pos), end - pos);
+
+		if (dptr->data && dptr->data[s_pos]) {
+			if (n == quantum) {
+				scull_free_slot(dev, dptr->data[s_pos]);
+				dptr->data[s_pos] = NULL;
+				freed = 1;
+			} else if (scull_slot_data(dptr->data[s_pos])) {
+				q = scull_slot_writable(dev, &dptr->data[s_pos]);
+				if (!q) {
+					return -ENOMEM;
+				}
+				memset(q + q_pos, 0, n);
+				scull_touch(dptr, s_pos);	// for the compactor
+			}
+		}
+		pos += n;
+
+		if (++s_pos == qset || pos >= end) {
+			// drop the pointer array too if nothing is left in it
+			if (freed) {
+				for (i = 0; i < qset && !dptr->data[i]; i++)
+					;
+				if (i == qset) {
+					scull_free_index(dev, dptr->data);
+					dptr->data = NULL;
+					scull_free_index(dev, dptr->atime);
+					dptr->atime = NULL;
+				}
+				freed = 0;
+			}
+			s_pos = 0;
+			dptr = dptr->next;
+		}
+	}
+	return 0;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-		loff_t *f_pos) {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM;
+extern struct file_operations scull_fops;
 
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+// Make dev a copy-on-write copy of the scull device open as fd: the
+// qset lists are duplicated, the quanta shared
+static int scull_clone(struct scull_dev *dev, int fd) {
+	struct scull_dev *src, *first, *second;
+	struct scull_qset *s, **dp;
+	struct scull_shared *sh;
+	struct fd f = fdget(fd);
+	int i, retval = 0;
 
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL) {
-		goto out;
-	}
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data) {
-			goto out;
-		}
-		memset(dptr->data, 0, qset * sizeof(char *));
+	if (!f.file) {
+		return -EBADF;
 	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos]) {
-			goto out;
-		}
+	if (f.file->f_op != &scull_fops || !(f.file->f_mode & FMODE_READ)) {
+		retval = -EINVAL;
+		goto out;
 	}
-	// Write only up to the end of this quantum
-	if (count > quantum - q_pos) {
-		count = quantum - q_pos;
+	src = f.file->private_data;
+	if (src == dev) {
+		retval = -EINVAL;
+		goto out;
 	}
 
-	if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-		retval = -EFAULT;
+	// Both devices change: the source's quanta become shared. Lock
+	// them in address order.
+	first = min(src, dev);
+	second = max(src, dev);
+	if (down_write_killable(&first->sem)) {
+		retval = -ERESTARTSYS;
 		goto out;
 	}
+	down_write_nested(&second->sem, SINGLE_DEPTH_NESTING);
 
-	*f_pos += count;
-	retval = count;
-
-	// Update the size
-	if (dev->size < *f_pos) {
-		dev->size = *f_pos;
+	if (dev->blk_openers) {
+		retval = -EBUSY;
+		goto unlock;
 	}
-	
-	printk("scull: write successfully\n");
+	scull_trim_deferred(dev);
+	dev->quantum = src->quantum;
+	dev->qset = src->qset;
+	dev->alloc = src->alloc;
+	dev->qcache = src->qcache;
+
+	for (s = src->data, dp = &dev->data; s; s = s->next, dp = &(*dp)->next) {
+		*dp = scull_alloc_index(dev, sizeof(struct scull_qset));
+		if (!*dp) {
+			goto nomem;
+		}
+		if (!s->data) {
+			continue;
+		}
+		(*dp)->data = scull_alloc_index(dev, src->qset * sizeof(void *));
+		if (!(*dp)->data) {
+			goto nomem;
+		}
+		for (i = 0; i < src->qset; i++) {
+			if (!s->data[i]) {
+				continue;
+			}
+			if (scull_is_zq(s->data[i]) && !scull_inflate(src, &s->data[i])) {
+				goto nomem;
+			}
+			if (!scull_is_shared(s->data[i])) {
+				sh = scull_share(src, s->data[i]);
+				if (!sh) {
+					goto nomem;
+				}
+				// the source's own reference, tagged
+				s->data[i] = (void *)((unsigned long)sh | SCULL_SHARED);
+			}
+			(*dp)->data[i] = scull_shared_slot(scull_to_shared(s->data[i]));
+		}
+	}
+	dev->size = src->size;
+	goto unlock;
+
+nomem:
+	// Drop the partial copy; what got shared in the source stays so
+	scull_trim_deferred(dev);
+	retval = -ENOMEM;
+unlock:
+	up_write(&second->sem);
+	up_write(&first->sem);
 out:
+	fdput(f);
 	return retval;
 }
 
 // The ioctl() implementation
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct scull_dev *dev = filp->private_data;
 	int err = 0, tmp;
 	int retval = 0;
 
@@ -534,14 +2685,10 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 		return -ENOTTY;
 	}
 
-	// the direction is a bitmask, and VERIFY_WRITE catches R/W
-	// transfers. `Type` is a user-oriented, while
-	// access_ok is kernel-oriented, so the concept of "read" and
-	// "write" is reserved
-	if (_IOC_DIR(cmd) & _IOC_READ) {
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	} else if (_IOC_DIR(cmd) & _IOC_WRITE) {
-		err = !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+	// the direction is a bitmask; access_ok() no longer cares which
+	// way the data goes, only that the range is in user space
+	if (_IOC_DIR(cmd) & (_IOC_READ | _IOC_WRITE)) {
+		err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
 	}
 	if (err) {
 		return -EFAULT;
@@ -549,45 +2696,111 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 	
 	switch (cmd) {
 	case SCULL_IOCRESET:
-		scull_quantum = SCULL_QUANTUM;
-		scull_qset = SCULL_QSET;
-		break;
+		tmp = dev->alloc;
+		if (tmp == SCULL_ALLOC_PAGES && !scull_pages_ok(scull_quantum)) {
+			tmp = scull_alloc_mode;
+		}
+		return scull_configure(dev, scull_quantum, scull_qset, tmp);
 	
 	case SCULL_IOCTQUANTUM: /* Tell: arg is the value */
 		if (!capable(CAP_SYS_ADMIN)) {
 			return -EPERM;
 		}
-		scull_quantum = arg;
-		break;
+		if (arg == 0 || arg > INT_MAX) {
+			return -EINVAL;
+		}
+		return scull_configure(dev, arg, 0, -1);
 	
 	case SCULL_IOCQQUANTUM: /* Query: return it (it's positive) */
-		return scull_quantum;
+		return dev->quantum;
 	
 	case SCULL_IOCHQUANTUM: /* sHift: like Tell + Query */
 		if (!capable(CAP_SYS_ADMIN)) {
 			return -EPERM;
 		}
-		tmp = scull_quantum;
-		scull_quantum = arg;
-		return tmp;
+		if (arg == 0 || arg > INT_MAX) {
+			return -EINVAL;
+		}
+		tmp = dev->quantum;
+		retval = scull_configure(dev, arg, 0, -1);
+		return retval ? retval : tmp;
 	
 	case SCULL_IOCTQSET:
 		if (!capable(CAP_SYS_ADMIN)) {
 			return -EPERM;
 		}
-		scull_qset = arg;
-		break;
+		if (arg == 0 || arg > INT_MAX) {
+			return -EINVAL;
+		}
+		return scull_configure(dev, 0, arg, -1);
 
 	case SCULL_IOCQQSET:
-		return scull_qset;
+		return dev->qset;
 
 	case SCULL_IOCHQSET:
 		if (!capable(CAP_SYS_ADMIN)) {
 			return -EPERM;
 		}
-		tmp= scull_qset;
-		scull_qset = arg;
-		return tmp;
+		if (arg == 0 || arg > INT_MAX) {
+			return -EINVAL;
+		}
+		tmp = dev->qset;
+		retval = scull_configure(dev, 0, arg, -1);
+		return retval ? retval : tmp;
+
+	case SCULL_IOCTALLOC: /* Tell: arg is a SCULL_ALLOC_* mode */
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		if (arg >= SCULL_ALLOC_NR) {
+			return -EINVAL;
+		}
+		return scull_configure(dev, 0, 0, arg);
+
+	case SCULL_IOCQALLOC:
+		return dev->alloc;
+
+	case SCULL_IOCPUNCH: {
+		struct scull_punch punch;
+
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		if (copy_from_user(&punch, (void __user *)arg, sizeof(punch))) {
+			return -EFAULT;
+		}
+		if ((loff_t)punch.offset < 0 || (loff_t)punch.len <= 0 ||
+				(loff_t)(punch.offset + punch.len) < 0) {
+			return -EINVAL;
+		}
+		if (down_write_killable(&dev->sem)) {
+			return -ERESTARTSYS;
+		}
+		retval = scull_punch_hole(dev, punch.offset, punch.len);
+		up_write(&dev->sem);
+		break;
+	}
+
+	case SCULL_IOCTNUMA: /* Tell: arg is a SCULL_NUMA_* policy */
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		if (arg >= SCULL_NUMA_NR) {
+			return -EINVAL;
+		}
+		down_write(&dev->sem);
+		dev->numa = arg;
+		up_write(&dev->sem);
+		break;
+
+	case SCULL_IOCQNUMA:
+		return dev->numa;
+
+	case SCULL_IOCCLONE: /* arg is the fd of the source device */
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		return scull_clone(dev, arg);
 
 	default: /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -600,9 +2813,11 @@ struct file_operations scull_fops = {
 	.owner	= THIS_MODULE,
 	.open	= scull_open,
 	.release = scull_release,
-	.read  = scull_read,
-	.write = scull_write,
+	.llseek = scull_llseek,
+	.read_iter  = scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
+	.splice_read = scull_splice_read,
 };
 
 // Set up the char_dev structure for this device
@@ -619,19 +2834,322 @@ static void scull_setup_cdev(struct scull_dev *dev, int index) {
 	}
 }
 
-// The proc filesystem: function to read and entry
-int scull_read_procmem(char *buf, char **start, off_t offset,
-			int count, int *eof, void *data) {
-	int i, len = 0;
+/*
+ * The block device: /dev/scullbN stores its sectors in the quanta of
+ * scullN, through the same read and write helpers as the char device.
+ * There is one hardware queue per CPU and every request is completed
+ * before queue_rq returns. Reads, and writes to sectors written before,
+ * share the device lock; only a first write, a copy-on-write or a
+ * discard has it to itself.
+ */
+static int scull_blk_segment(struct scull_dev *dev, struct bio_vec *bvec,
+		loff_t pos, int write) {
+	struct iov_iter iter;
+	ssize_t n;
+
+	iov_iter_bvec(&iter, write ? WRITE : READ, bvec, 1, bvec->bv_len);
+	while (iov_iter_count(&iter)) {
+		n = write ? scull_do_write(dev, NULL, &pos, &iter) :
+			scull_do_read(dev, NULL, &pos, &iter);
+		if (n < 0) {
+			return n;
+		}
+		if (!n) {
+			// past the data written so far: zeros
+			iov_iter_zero(iov_iter_count(&iter), &iter);
+			break;
+		}
+	}
+	return 0;
+}
+
+static blk_status_t scull_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd) {
+	struct scull_dev *dev = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	blk_status_t status = BLK_STS_OK;
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	unsigned int noio;
+	int err;
+
+	blk_mq_start_request(rq);
+	// Allocating quanta must not recurse into I/O, possibly to this disk
+	noio = memalloc_noio_save();
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		rq_for_each_segment(bvec, rq, iter) {
+			if (scull_blk_segment(dev, &bvec, pos, op_is_write(req_op(rq)))) {
+				status = BLK_STS_IOERR;
+				break;
+			}
+			pos += bvec.bv_len;
+		}
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		down_write(&dev->sem);
+		err = scull_punch_hole(dev, pos, blk_rq_bytes(rq));
+		up_write(&dev->sem);
+		if (err) {
+			// only a copy-on-write edge can fail, for memory
+			status = err == -ENOMEM ? BLK_STS_RESOURCE : BLK_STS_IOERR;
+		}
+		break;
+	case REQ_OP_FLUSH:
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+	memalloc_noio_restore(noio);
+	blk_mq_end_request(rq, status);
+	return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops scull_mq_ops = {
+	.queue_rq	= scull_queue_rq,
+};
+
+// Count the opens of the disk: the char device must not trim or
+// reshape the data under them
+static int scull_blk_open(struct block_device *bdev, fmode_t mode) {
+	struct scull_dev *dev = bdev->bd_disk->private_data;
+
+	if (down_write_killable(&dev->sem)) {
+		return -ERESTARTSYS;
+	}
+	dev->blk_openers++;
+	up_write(&dev->sem);
+	return 0;
+}
+
+static void scull_blk_release(struct gendisk *disk, fmode_t mode) {
+	struct scull_dev *dev = disk->private_data;
+
+	down_write(&dev->sem);
+	dev->blk_openers--;
+	up_write(&dev->sem);
+}
+
+static const struct block_device_operations scull_blk_fops = {
+	.owner		= THIS_MODULE,
+	.open		= scull_blk_open,
+	.release	= scull_blk_release,
+};
+
+static int scull_blk_add(struct scull_dev *dev, int index) {
+	struct blk_mq_tag_set *set = &dev->tag_set;
+	struct gendisk *disk;
+	int err;
+
+	set->ops = &scull_mq_ops;
+	set->nr_hw_queues = nr_cpu_ids;
+	set->nr_maps = 1;
+	set->queue_depth = 128;
+	set->numa_node = NUMA_NO_NODE;
+	// queue_rq sleeps on the device semaphore and in the allocator
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	err = blk_mq_alloc_tag_set(set);
+	if (err) {
+		return err;
+	}
+
+	disk = blk_mq_alloc_disk(set, dev);
+	if (IS_ERR(disk)) {
+		blk_mq_free_tag_set(set);
+		return PTR_ERR(disk);
+	}
+	disk->major = scull_blk_major;
+	disk->first_minor = index;
+	disk->minors = 1;
+	disk->fops = &scull_blk_fops;
+	disk->private_data = dev;
+	snprintf(disk->disk_name, DISK_NAME_LEN, "scullb%d", index);
+	set_capacity(disk, (sector_t)scull_blk_mb << (20 - SECTOR_SHIFT));
+
+	blk_queue_physical_block_size(disk->queue, PAGE_SIZE);
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, disk->queue);
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, disk->queue);
+	disk->queue->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_discard_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+	blk_queue_max_write_zeroes_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+
+	err = add_disk(disk);
+	if (err) {
+		blk_cleanup_disk(disk);
+		blk_mq_free_tag_set(set);
+		return err;
+	}
+	dev->disk = disk;
+	return 0;
+}
+
+static void scull_blk_del(struct scull_dev *dev) {
+	if (!dev->disk) {
+		return;
+	}
+	del_gendisk(dev->disk);
+	blk_cleanup_disk(dev->disk);
+	blk_mq_free_tag_set(&dev->tag_set);
+	dev->disk = NULL;
+}
+
+// The sysfs side: /sys/class/scull/scullN/ has the same knobs as the
+// ioctls, plus the per-node memory usage
+static ssize_t quantum_show(struct device *d, struct device_attribute *attr,
+		char *buf) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%d\n", dev->quantum);
+}
+
+static ssize_t quantum_store(struct device *d, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+	int val, err;
+
+	err = kstrtoint(buf, 0, &val);
+	if (err) {
+		return err;
+	}
+	if (val <= 0) {
+		return -EINVAL;
+	}
+	err = scull_configure(dev, val, 0, -1);
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(quantum);
+
+static ssize_t qset_show(struct device *d, struct device_attribute *attr,
+		char *buf) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%d\n", dev->qset);
+}
+
+static ssize_t qset_store(struct device *d, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+	int val, err;
+
+	err = kstrtoint(buf, 0, &val);
+	if (err) {
+		return err;
+	}
+	if (val <= 0) {
+		return -EINVAL;
+	}
+	err = scull_configure(dev, 0, val, -1);
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(qset);
+
+static ssize_t alloc_show(struct device *d, struct device_attribute *attr,
+		char *buf) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%s\n", scull_alloc_names[dev->alloc]);
+}
+
+static ssize_t alloc_store(struct device *d, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+	int mode, err;
+
+	for (mode = 0; mode < SCULL_ALLOC_NR; mode++) {
+		if (sysfs_streq(buf, scull_alloc_names[mode])) {
+			break;
+		}
+	}
+	if (mode == SCULL_ALLOC_NR) {
+		return -EINVAL;
+	}
+	err = scull_configure(dev, 0, 0, mode);
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(alloc);
+
+static ssize_t numa_show(struct device *d, struct device_attribute *attr,
+		char *buf) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%s\n", scull_numa_names[dev->numa]);
+}
+
+static ssize_t numa_store(struct device *d, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+	int policy;
+
+	for (policy = 0; policy < SCULL_NUMA_NR; policy++) {
+		if (sysfs_streq(buf, scull_numa_names[policy])) {
+			break;
+		}
+	}
+	if (policy == SCULL_NUMA_NR) {
+		return -EINVAL;
+	}
+	if (down_write_killable(&dev->sem)) {
+		return -ERESTARTSYS;
+	}
+	dev->numa = policy;
+	up_write(&dev->sem);
+	return count;
+}
+static DEVICE_ATTR_RW(numa);
+
+// One "node<N> <bytes>" line per node with memory
+static ssize_t node_bytes_show(struct device *d, struct device_attribute *attr,
+		char *buf) {
+	struct scull_dev *dev = dev_get_drvdata(d);
+	int node, len = 0;
+
+	for_each_node_state(node, N_MEMORY) {
+		len += sprintf(buf + len, "node%d %li\n", node,
+				atomic_long_read(&dev->node_bytes[node]));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(node_bytes);
+
+static struct attribute *scull_attrs[] = {
+	&dev_attr_quantum.attr,
+	&dev_attr_qset.attr,
+	&dev_attr_alloc.attr,
+	&dev_attr_numa.attr,
+	&dev_attr_node_bytes.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(scull);
+
+// The proc filesystem: a summary of every device in one show
+static int scull_mem_show(struct seq_file *s, void *v) {
+	int i, node;
 
 	for (i = 0; i < SCULL_NR_DEVS; i++) {
 		struct scull_dev *d = &scull_devices[i];
+		long qbytes = atomic_long_read(&d->qbytes);
+		long ibytes = atomic_long_read(&d->ibytes);
 		
-		len += sprintf(buf + len, "\nDevice %i: qset %i, q %i, sz %li\n", i, d->qset, d->quantum, d->size);
+		seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n", i, d->qset, d->quantum, d->size);
+		// overhead is what we pay on top of the bytes stored, in 1/1000
+		seq_printf(s, "  alloc %s, quanta %li, quantum mem %li, index mem %li, overhead %li/1000\n",
+				scull_alloc_names[d->alloc],
+				atomic_long_read(&d->nquanta), qbytes, ibytes,
+				d->size ? (long)((qbytes + ibytes - d->size) * 1000 / d->size) : 0);
+		seq_printf(s, "  numa %s:", scull_numa_names[d->numa]);
+		for_each_node_state(node, N_MEMORY) {
+			seq_printf(s, " node%d %li", node,
+					atomic_long_read(&d->node_bytes[node]));
+		}
+		seq_putc(s, '\n');
 	}
-	*eof = 1;
 
-	return len;
+	return 0;
 }
 
 // Here are our sequence iteration methods. Our "postion" is
@@ -663,6 +3181,24 @@ static int scull_seq_show(struct seq_file *s, void *v) {
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 		(int) (dev - scull_devices), dev->qset,
 		dev->quantum, dev->size);
+	seq_printf(s, " alloc %s, quanta %li, quantum mem %li, index mem %li\n",
+		scull_alloc_names[dev->alloc],
+		atomic_long_read(&dev->nquanta),
+		atomic_long_read(&dev->qbytes),
+		atomic_long_read(&dev->ibytes));
+#ifdef SCULL_COMPRESS
+	if (scull_zpool) {
+		long orig = atomic_long_read(&dev->zorig);
+		long zbytes = atomic_long_read(&dev->zbytes);
+
+		seq_printf(s, " compressed %li quanta, %li -> %li bytes, ratio %li.%02li, "
+			"faults %li (%li/s)\n",
+			atomic_long_read(&dev->nzq), orig, zbytes,
+			zbytes ? orig / zbytes : 0,
+			zbytes ? orig * 100 / zbytes % 100 : 0,
+			atomic_long_read(&dev->zfaults), dev->zfault_rate);
+	}
+#endif
 	for (d = dev->data; d; d = d->next) { // scan the list
 		seq_printf(s, " item at %p, qset at %p\n", d, d->data);
 		if (d->data && !d->next) {
@@ -691,25 +3227,53 @@ static int scull_proc_open(struct inode *inode, struct file *file) {
 	return seq_open(file, &scull_seq_ops);
 }
 
-// Create a set of file operations for our proc file
-static struct file_operations scull_proc_ops = {
-	.owner	= THIS_MODULE,
-	.open	= scull_proc_open,
-	.read	= seq_read,
-	.llseek = seq_lseek,
-	.release = seq_release
+// Create a set of proc operations for our proc file
+static const struct proc_ops scull_proc_ops = {
+	.proc_open	= scull_proc_open,
+	.proc_read	= seq_read,
+	.proc_lseek	= seq_lseek,
+	.proc_release	= seq_release
 };
 
+// debugfs: one line of counters per device
+static void scull_stats_show_one(struct seq_file *s, const char *name, int i,
+		struct scull_stats __percpu *stats) {
+	struct scull_stats sum = { 0 }, *c;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(stats, cpu);
+		sum.reads += c->reads;
+		sum.read_bytes += c->read_bytes;
+		sum.writes += c->writes;
+		sum.write_bytes += c->write_bytes;
+		sum.sleeps += c->sleeps;
+		sum.wait_ns += c->wait_ns;
+	}
+	seq_printf(s, "%s%d %llu %llu %llu %llu %llu %llu\n", name, i,
+			sum.reads, sum.read_bytes, sum.writes, sum.write_bytes,
+			sum.sleeps, sum.wait_ns);
+}
+
+static int scull_stats_show(struct seq_file *s, void *v) {
+	int i;
+
+	seq_puts(s, "device reads read_bytes writes write_bytes sleeps wait_ns\n");
+	for (i = 0; i < SCULL_NR_DEVS; i++) {
+		scull_stats_show_one(s, "scull", i, scull_devices[i].stats);
+	}
+	for (i = 0; scull_p_devices && i < scull_p_nr_devs; i++) {
+		scull_stats_show_one(s, "scullpipe", i, scull_p_devices[i].stats);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
 // Acutally create (and remove) the /proc file(s)
 static void scull_create_proc(void) {
-	struct proc_dir_entry *entry;
-	create_proc_read_entry("scullmem", 0 /* default mode */,
-				NULL /* parent dir */, scull_read_procmem,
-				NULL /* client data */);
-	entry = create_proc_entry("scullseq", 0, NULL);
-	if (entry) {
-		entry->proc_fops = &scull_proc_ops;
-	}
+	proc_create_single("scullmem", 0 /* default mode */,
+				NULL /* parent dir */, scull_mem_show);
+	proc_create("scullseq", 0, NULL, &scull_proc_ops);
 }
 
 static void scull_remove_proc(void) {
@@ -730,6 +3294,22 @@ int scull_init_module(void) {
 	scull_major = MAJOR(dev);
 	printk("scull: major number is %d\n", scull_major);
 
+	scull_trim_wq = alloc_workqueue("scull_trim", WQ_UNBOUND, 0);
+	if (!scull_trim_wq) {
+		result = -ENOMEM;
+		goto fail;
+	}
+
+	if (scull_quantum <= 0 || scull_qset <= 0 ||
+			(long)scull_quantum * scull_qset > INT_MAX) {
+		scull_quantum = SCULL_QUANTUM;
+		scull_qset = SCULL_QSET;
+	}
+	if (scull_alloc_mode < 0 || scull_alloc_mode >= SCULL_ALLOC_NR ||
+			(scull_alloc_mode == SCULL_ALLOC_PAGES && !scull_pages_ok(scull_quantum))) {
+		scull_alloc_mode = SCULL_ALLOC_KMALLOC;
+	}
+
 	scull_devices = kmalloc(SCULL_NR_DEVS*sizeof(struct scull_dev), GFP_KERNEL);
 	if (!scull_devices) {
 		result = -ENOMEM;
@@ -737,11 +3317,70 @@ int scull_init_module(void) {
 	}
 	memset(scull_devices, 0, SCULL_NR_DEVS * sizeof(struct scull_dev));
 
+	scull_class = class_create(THIS_MODULE, "scull");
+	if (IS_ERR(scull_class)) {
+		result = PTR_ERR(scull_class);
+		scull_class = NULL;
+		goto fail;
+	}
+	scull_class->dev_groups = scull_groups;
+
+	for (i = 0; i < SCULL_NR_DEVS; i++) {
+		scull_devices[i].node_bytes = kcalloc(nr_node_ids,
+				sizeof(atomic_long_t), GFP_KERNEL);
+		scull_devices[i].stats = alloc_percpu(struct scull_stats);
+		if (!scull_devices[i].node_bytes || !scull_devices[i].stats) {
+			result = -ENOMEM;
+			goto fail;
+		}
+	}
+
 	for (i = 0; i < SCULL_NR_DEVS; i++) {
 		scull_devices[i].quantum = scull_quantum;
 		scull_devices[i].qset = scull_qset;
+		scull_devices[i].alloc = scull_alloc_mode;
+		scull_devices[i].numa = SCULL_NUMA_ANY;
+		scull_devices[i].next_node = NUMA_NO_NODE;
+		init_rwsem(&scull_devices[i].sem);
+		INIT_LIST_HEAD(&scull_devices[i].dead);
+		spin_lock_init(&scull_devices[i].dead_lock);
+		INIT_DELAYED_WORK(&scull_devices[i].trim_work, scull_trim_work);
+#ifdef SCULL_COMPRESS
+		INIT_DELAYED_WORK(&scull_devices[i].compact_work, scull_compact_work);
+#endif
 		scull_setup_cdev(&scull_devices[i], i);
+		device_create(scull_class, NULL, MKDEV(scull_major, scull_minor + i),
+				&scull_devices[i], "scull%d", i);
+	}
+
+	// The block devices are optional: the char devices work without
+	if (scull_blk_mb > 0) {
+		scull_blk_major = register_blkdev(0, "scullb");
+		if (scull_blk_major < 0) {
+			printk(KERN_WARNING "scull: can't get a block major, no scullb\n");
+			scull_blk_major = 0;
+		}
+		for (i = 0; scull_blk_major && i < SCULL_NR_DEVS; i++) {
+			result = scull_blk_add(&scull_devices[i], i);
+			if (result) {
+				printk(KERN_WARNING "scull: error %d adding scullb%d\n", result, i);
+			}
+		}
+	}
+
+#ifdef SCULL_COMPRESS
+	if (scull_compress_ms > 0) {
+		scull_zpool = zs_create_pool("scull");
+		if (!scull_zpool) {
+			printk(KERN_WARNING "scull: no zsmalloc pool, not compressing\n");
+		}
+		for (i = 0; scull_zpool && i < SCULL_NR_DEVS; i++) {
+			scull_devices[i].zlast = jiffies;
+			queue_delayed_work(scull_trim_wq, &scull_devices[i].compact_work,
+					msecs_to_jiffies(scull_compress_ms));
+		}
 	}
+#endif
 
 	// At this point call the init funciton for any friend device
 	dev = MKDEV(scull_major, scull_minor + SCULL_NR_DEVS);
@@ -749,6 +3388,9 @@ int scull_init_module(void) {
 	
 	scull_create_proc();
 
+	scull_debugfs = debugfs_create_dir("scull", NULL);
+	debugfs_create_file("stats", S_IRUGO, scull_debugfs, NULL, &scull_stats_fops);
+
 	printk("scull: module init succeed\n");
 	return 0; /* succeed */
 
@@ -759,14 +3401,69 @@ fail:
 
 void scull_cleanup_module(void) {
 	dev_t devno = MKDEV(scull_major, scull_minor);
+	int i;
 
 	scull_remove_proc();
+	debugfs_remove_recursive(scull_debugfs);
+
+	// No more block requests before the data goes
+	if (scull_devices) {
+		for (i = 0; i < SCULL_NR_DEVS; i++) {
+			scull_blk_del(scull_devices + i);
+		}
+	}
+	if (scull_blk_major) {
+		unregister_blkdev(scull_blk_major, "scullb");
+		scull_blk_major = 0;
+	}
+
+	// Get rid of our char dev entries and of the data they hold. A
+	// failed init may have stopped before setting some devices up.
+	if (scull_devices) {
+		for (i = 0; i < SCULL_NR_DEVS; i++) {
+			if (scull_devices[i].cdev.ops) {
+				device_destroy(scull_class, MKDEV(scull_major, scull_minor + i));
+				cdev_del(&scull_devices[i].cdev);
+				cancel_delayed_work_sync(&scull_devices[i].trim_work);
+#ifdef SCULL_COMPRESS
+				cancel_delayed_work_sync(&scull_devices[i].compact_work);
+#endif
+				scull_trim(scull_devices + i);
+			}
+		}
+		// Shared quanta are charged to the device that allocated
+		// them, so the counters go only once every device is empty
+		for (i = 0; i < SCULL_NR_DEVS; i++) {
+			kfree(scull_devices[i].node_bytes);
+			free_percpu(scull_devices[i].stats);
+		}
+		kfree(scull_devices);
+		scull_devices = NULL;
+	}
+	if (scull_class) {
+		class_destroy(scull_class);
+		scull_class = NULL;
+	}
 
 	unregister_chrdev_region(devno, SCULL_NR_DEVS);
 
+	if (scull_trim_wq) {
+		destroy_workqueue(scull_trim_wq);
+		scull_trim_wq = NULL;
+	}
+
 	// call the cleanup functions for friend devices
 	scull_p_cleanup();
 
+	// Every quantum is gone now, so are the users of the caches
+	scull_destroy_qcaches();
+#ifdef SCULL_COMPRESS
+	if (scull_zpool) {
+		zs_destroy_pool(scull_zpool);
+		scull_zpool = NULL;
+	}
+#endif
+
 	printk("scull: module clean up succeed\n");
 }
 
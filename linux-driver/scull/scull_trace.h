@@ -0,0 +1,132 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints for the scull data paths. They cost a static branch when
+ * disabled, so they can stay in the hot paths; enable them with
+ * ftrace (events/scull/) or perf (-e 'scull:*').
+ */
+
+// read() and write() on /dev/scullN: where, how much asked, what we did
+DECLARE_EVENT_CLASS(scull_rw,
+	TP_PROTO(dev_t devno, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(devno, pos, count, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devno)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d:%d pos %lld count %zu ret %zd",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(scull_rw, scull_read,
+	TP_PROTO(dev_t devno, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(devno, pos, count, ret)
+);
+
+DEFINE_EVENT(scull_rw, scull_write,
+	TP_PROTO(dev_t devno, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(devno, pos, count, ret)
+);
+
+// read() and write() on /dev/scullpipeN, with the fill level after it
+DECLARE_EVENT_CLASS(scull_pipe_rw,
+	TP_PROTO(dev_t devno, size_t count, ssize_t ret, unsigned int fill),
+	TP_ARGS(devno, count, ret, fill),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devno)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(unsigned int, fill)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->fill = fill;
+	),
+
+	TP_printk("dev %d:%d count %zu ret %zd fill %u",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->count, __entry->ret, __entry->fill)
+);
+
+DEFINE_EVENT(scull_pipe_rw, scull_pipe_read,
+	TP_PROTO(dev_t devno, size_t count, ssize_t ret, unsigned int fill),
+	TP_ARGS(devno, count, ret, fill)
+);
+
+DEFINE_EVENT(scull_pipe_rw, scull_pipe_write,
+	TP_PROTO(dev_t devno, size_t count, ssize_t ret, unsigned int fill),
+	TP_ARGS(devno, count, ret, fill)
+);
+
+// A pipe reader or writer going to sleep
+TRACE_EVENT(scull_sleep,
+	TP_PROTO(dev_t devno, int writer),
+	TP_ARGS(devno, writer),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devno)
+		__field(int, writer)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->writer = writer;
+	),
+
+	TP_printk("dev %d:%d %s",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->writer ? "writer" : "reader")
+);
+
+// ... and waking up, with the time it spent asleep
+TRACE_EVENT(scull_wake,
+	TP_PROTO(dev_t devno, int writer, u64 wait_ns),
+	TP_ARGS(devno, writer, wait_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devno)
+		__field(int, writer)
+		__field(u64, wait_ns)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->writer = writer;
+		__entry->wait_ns = wait_ns;
+	),
+
+	TP_printk("dev %d:%d %s waited %llu ns",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->writer ? "writer" : "reader", __entry->wait_ns)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+// This part must be outside the header guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
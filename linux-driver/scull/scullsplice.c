@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+// Compare the ways of moving data out of a scull device:
+// read()+write() through a user buffer, splice() through a pipe,
+// and sendfile(). The source is either /dev/scullN, filled up front,
+// or /dev/scullpipeN, fed by a producer thread during each run.
+//
+// usage: scullsplice [-n bytes] [-b chunk] [source [destination]]
+
+static size_t total = 64 << 20;		// bytes moved per method
+static size_t chunk = 64 << 10;		// per call
+static const char *src = "/dev/scull0";
+static const char *dst = "/dev/null";
+static int is_pipe;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write total bytes to the source device
+static void *producer(void *arg) {
+	char *buf = malloc(chunk);
+	size_t left = total;
+	ssize_t n;
+	int fd;
+
+	if (!buf || (fd = open(src, O_WRONLY)) == -1) {
+		perror("producer: open");
+		exit(1);
+	}
+	memset(buf, 'x', chunk);
+	while (left) {
+		n = write(fd, buf, left < chunk ? left : chunk);
+		if (n < 0) {
+			perror("producer: write");
+			exit(1);
+		}
+		left -= n;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static ssize_t run_readwrite(int in, int out) {
+	char *buf = malloc(chunk);
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < total && (n = read(in, buf, chunk)) > 0) {
+		if (write(out, buf, n) != n) {
+			perror("write");
+			break;
+		}
+		done += n;
+	}
+	free(buf);
+	return done;
+}
+
+static ssize_t run_splice(int in, int out) {
+	size_t done = 0;
+	ssize_t n, m;
+	int p[2];
+
+	if (pipe(p)) {
+		perror("pipe");
+		return -1;
+	}
+	fcntl(p[1], F_SETPIPE_SZ, chunk);
+	while (done < total) {
+		n = splice(in, NULL, p[1], NULL, chunk, SPLICE_F_MOVE);
+		if (n <= 0) {
+			if (n < 0) {
+				perror("splice in");
+			}
+			break;
+		}
+		done += n;
+		while (n) {
+			m = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE);
+			if (m <= 0) {
+				perror("splice out");
+				goto out;
+			}
+			n -= m;
+		}
+	}
+out:
+	close(p[0]);
+	close(p[1]);
+	return done;
+}
+
+static ssize_t run_sendfile(int in, int out) {
+	size_t done = 0;
+	ssize_t n = 0;
+
+	while (done < total && (n = sendfile(out, in, NULL, chunk)) > 0) {
+		done += n;
+	}
+	if (n < 0) {
+		perror("sendfile");
+	}
+	return done;
+}
+
+static void bench(const char *name, ssize_t (*fn)(int, int)) {
+	pthread_t tid;
+	double t0, t;
+	ssize_t done;
+	int in, out;
+
+	if (!is_pipe) {
+		producer(NULL);	// fill the device, then read it back
+	}
+	if ((in = open(src, O_RDONLY)) == -1) {
+		perror("open source");
+		exit(1);
+	}
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		perror("open destination");
+		exit(1);
+	}
+	if (is_pipe) {
+		pthread_create(&tid, NULL, producer, NULL);
+	}
+
+	t0 = now();
+	done = fn(in, out);
+	t = now() - t0;
+
+	if (is_pipe) {
+		pthread_join(tid, NULL);
+	}
+	close(in);
+	close(out);
+
+	printf("%-10s %12zd bytes %8.3f s %10.1f MB/s\n", name, done, t,
+			done / t / (1 << 20));
+}
+
+int main(int argc, char **argv) {
+	int c;
+
+	while ((c = getopt(argc, argv, "n:b:")) != -1) {
+		switch (c) {
+		case 'n':
+			total = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			chunk = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n bytes] [-b chunk] [source [destination]]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		src = argv[optind++];
+	}
+	if (optind < argc) {
+		dst = argv[optind++];
+	}
+	is_pipe = strstr(src, "pipe") != NULL;
+
+	printf("%s -> %s, %zu bytes in chunks of %zu\n", src, dst, total, chunk);
+	bench("read/write", run_readwrite);
+	bench("splice", run_splice);
+	bench("sendfile", run_sendfile);
+
+	return 0;
+}
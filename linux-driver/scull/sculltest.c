@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <linux/ioctl.h>
 
 // Use 'k' as magic number
@@ -17,42 +23,392 @@
 #define SCULL_IOCHQUANTUM       _IO(SCULL_IOC_MAGIC, 5)
 #define SCULL_IOCHQSET          _IO(SCULL_IOC_MAGIC, 6)
 
+/*
+ * Throughput and latency benchmarks of scull and scullpipe.
+ *
+ * seq, rand: threads write then read back /dev/scullN with pwrite and
+ * pread, sequentially in a region of their own or at random blocks,
+ * for every block size, quantum and thread count given.
+ * pipe: pairs of producers and consumers on /dev/scullpipeN, with
+ * blocking I/O and with O_NONBLOCK plus poll().
+ *
+ * Every run prints MB/s, ops/s and latency percentiles per operation;
+ * -o also writes them as CSV, to compare driver changes to a baseline.
+ *
+ * usage: sculltest [-n bytes] [-b sizes] [-q quanta] [-j threads]
+ *                  [-s suites] [-d scull] [-p scullpipe] [-o csv]
+ * Lists are comma separated, e.g. -b 512,4096 -s seq,pipe.
+ * Setting the quantum needs CAP_SYS_ADMIN; 0 keeps the device's own.
+ */
 
-int main() {
-	int fd, cmd, quantum;
-	int n, flags;
-	char buf[1024];
+#define MAXLIST 16
 
-	if ((fd = open("/dev/scull0", O_WRONLY)) == -1) {
-		perror("open scull failed");
-		return -1;
+struct list {
+	int n;
+	long v[MAXLIST];
+};
+
+static size_t total = 64 << 20;		// bytes per run
+static struct list bsizes = { 4, { 512, 4096, 65536, 1 << 20 } };
+static struct list quanta = { 3, { 4000, 4096, 65536 } };
+static struct list threads = { 4, { 1, 2, 4, 8 } };
+static const char *suites = "seq,rand,pipe";
+static const char *sdev = "/dev/scull0";
+static const char *pdev = "/dev/scullpipe0";
+static FILE *csv;
+
+// One benchmark thread
+struct worker {
+	pthread_t tid;
+	int fd;
+	int write;		// writer (producer) or reader (consumer)
+	int random;
+	int nonblock;
+	size_t bs;
+	off_t start;		// region of a seq thread
+	size_t bytes;		// what this thread moves
+	off_t span;		// device size, for rand
+	unsigned int seed;
+	long *lat;		// ns per op
+	long nops;
+	char *buf;
+};
+
+static long nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void parse_list(struct list *l, char *arg) {
+	char *tok;
+
+	l->n = 0;
+	for (tok = strtok(arg, ","); tok && l->n < MAXLIST; tok = strtok(NULL, ",")) {
+		l->v[l->n++] = strtol(tok, NULL, 0);
 	}
+}
 
-	cmd = SCULL_IOCHQUANTUM;
-	quantum = 8000;
-	quantum = ioctl(fd, SCULL_IOCHQUANTUM, quantum);
-	if (quantum < 0) {
-		perror("ioctl failed");
-		return -1;
+// Wait until fd is ready for the way we use it
+static void wait_ready(int fd, int write) {
+	struct pollfd p = { .fd = fd, .events = write ? POLLOUT : POLLIN };
+
+	poll(&p, 1, -1);
+}
+
+// Move w->bytes in blocks of w->bs. A call may come back short (at
+// the end of a quantum, or with a pipe), so a block takes as many
+// calls as it needs, and counts as one op.
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	size_t done = 0, len, got;
+	off_t off;
+	ssize_t n = 0;
+	long t0;
+
+	if (w->fd < 0) {
+		return NULL;
 	}
-	printf("old quantum is %d\n", quantum);
+	while (done < w->bytes) {
+		len = w->bytes - done < w->bs ? w->bytes - done : w->bs;
+		if (w->random) {
+			off = (rand_r(&w->seed) % (w->span / w->bs)) * w->bs;
+		} else {
+			off = w->start + done;
+		}
 
-	close(fd);
+		t0 = nsec();
+		for (got = 0; got < len; got += n) {
+			if (w->start < 0) {	// pipe
+				n = w->write ? write(w->fd, w->buf + got, len - got) :
+					read(w->fd, w->buf + got, len - got);
+			} else {
+				n = w->write ? pwrite(w->fd, w->buf + got, len - got, off + got) :
+					pread(w->fd, w->buf + got, len - got, off + got);
+			}
+			if (n < 0 && errno == EAGAIN) {
+				wait_ready(w->fd, w->write);
+				n = 0;
+				continue;
+			}
+			if (n <= 0) {
+				break;
+			}
+		}
+		w->lat[w->nops++] = nsec() - t0;
+
+		if (n <= 0) {
+			if (n < 0) {
+				perror(w->write ? "write" : "read");
+			}
+			break;
+		}
+		done += got;
+	}
+	return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Merge the latencies of ws[0..n) and print one result line
+static void report(const char *test, const char *op, size_t bs, long quantum,
+		int nthreads, struct worker *ws, int n, size_t bytes, long ns) {
+	long *all, nops = 0;
+	double secs = ns / 1e9, p[5];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		nops += ws[i].nops;
+	}
+	all = malloc((nops ? nops : 1) * sizeof(long));
+	for (nops = 0, i = 0; i < n; i++) {
+		memcpy(all + nops, ws[i].lat, ws[i].nops * sizeof(long));
+		nops += ws[i].nops;
+	}
+	qsort(all, nops, sizeof(long), cmp_long);
+	memset(p, 0, sizeof(p));
+	if (nops) {
+		p[0] = all[nops / 2] / 1e3;
+		p[1] = all[nops * 90 / 100] / 1e3;
+		p[2] = all[nops * 99 / 100] / 1e3;
+		p[3] = all[nops * 999 / 1000] / 1e3;
+		p[4] = all[nops - 1] / 1e3;
+	}
+	free(all);
+
+	printf("%-9s %-5s %8zu %6ld %3d %10.1f %10.0f %9.1f %9.1f %9.1f %9.1f %10.1f\n",
+			test, op, bs, quantum, nthreads, bytes / secs / (1 << 20),
+			nops / secs, p[0], p[1], p[2], p[3], p[4]);
+	if (csv) {
+		fprintf(csv, "%s,%s,%zu,%ld,%d,%zu,%.6f,%.2f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+				test, op, bs, quantum, nthreads, bytes, secs,
+				bytes / secs / (1 << 20), nops / secs,
+				p[0], p[1], p[2], p[3], p[4]);
+		fflush(csv);
+	}
+}
+
+static struct worker *alloc_workers(int n, size_t bs, size_t bytes) {
+	struct worker *ws = calloc(n, sizeof(*ws));
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ws[i].bs = bs;
+		ws[i].bytes = bytes;
+		ws[i].seed = i + 1;
+		ws[i].lat = malloc((bytes / bs + 1) * sizeof(long));
+		ws[i].buf = malloc(bs);
+		if (!ws[i].lat || !ws[i].buf) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memset(ws[i].buf, 'a' + i % 26, bs);
+	}
+	return ws;
+}
+
+static void free_workers(struct worker *ws, int n) {
+	int i;
 
-	if ((fd = open("/dev/scullpipe0", O_RDONLY)) == -1) {
-		perror("open scullpipe failed\n");
+	for (i = 0; i < n; i++) {
+		free(ws[i].lat);
+		free(ws[i].buf);
+	}
+	free(ws);
+}
+
+// Start n workers and wait for them; returns the elapsed time in ns
+static long run(struct worker *ws, int n) {
+	long t0 = nsec();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		pthread_create(&ws[i].tid, NULL, run_worker, &ws[i]);
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(ws[i].tid, NULL);
+	}
+	return nsec() - t0;
+}
+
+// Empty the device and give it a new quantum
+static int reset_scull(long quantum) {
+	int fd = open(sdev, O_WRONLY);	// write-only open trims the device
+
+	if (fd == -1) {
+		perror(sdev);
 		return -1;
 	}
+	if (quantum && ioctl(fd, SCULL_IOCTQUANTUM, quantum) < 0) {
+		perror("SCULL_IOCTQUANTUM");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// Write the device with nthreads threads, then read it back
+static void bench_scull(int random, size_t bs, long quantum, int nthreads) {
+	const char *test = random ? "rand" : "seq";
+	size_t per = total / nthreads / bs * bs;
+	struct worker *ws;
+	int fd, i, op;
+	long ns;
+
+	if (!per || reset_scull(quantum)) {
+		return;
+	}
+	if ((fd = open(sdev, O_RDWR)) == -1) {
+		perror(sdev);
+		return;
+	}
+	ws = alloc_workers(nthreads, bs, per);
 
-	flags = fcntl(fd, F_GETFL, 0);
-	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	for (op = 1; op >= 0; op--) {
+		for (i = 0; i < nthreads; i++) {
+			ws[i].fd = fd;
+			ws[i].write = op;
+			ws[i].random = random;
+			ws[i].start = (off_t)i * per;
+			ws[i].span = (off_t)per * nthreads;
+			ws[i].nops = 0;
+		}
+		// Random writes leave holes: fill the device first so that
+		// the reads see data
+		if (random && op == 0) {
+			for (i = 0; i < nthreads; i++) {
+				ws[i].random = 0;
+				ws[i].write = 1;
+			}
+			run(ws, nthreads);
+			for (i = 0; i < nthreads; i++) {
+				ws[i].random = 1;
+				ws[i].write = 0;
+				ws[i].nops = 0;
+			}
+		}
+		ns = run(ws, nthreads);
+		report(test, op ? "write" : "read", bs, quantum, nthreads, ws, nthreads,
+				per * nthreads, ns);
+	}
+
+	free_workers(ws, nthreads);
+	close(fd);
+}
+
+// npairs producers and as many consumers on the pipe
+static void bench_pipe(int nonblock, size_t bs, int npairs) {
+	size_t per = total / npairs / bs * bs;
+	struct worker *ws;
+	int i, flags;
+	long ns;
 
-	while( (n = read(fd, buf, sizeof(buf))) == -1) {
-		perror("read failed");
-		sleep(1);
+	if (!per) {
+		return;
 	}
-	printf("%s\n", buf);
+	ws = alloc_workers(2 * npairs, bs, per);
+	flags = nonblock ? O_NONBLOCK : 0;
+	for (i = 0; i < 2 * npairs; i++) {
+		ws[i].write = i < npairs;
+		ws[i].nonblock = nonblock;
+		ws[i].start = -1;
+		// Every consumer takes exactly its share, so none is left
+		// waiting once the producers are done
+		ws[i].fd = open(pdev, (ws[i].write ? O_WRONLY : O_RDONLY) | flags);
+		if (ws[i].fd == -1) {
+			perror(pdev);
+		}
+	}
+
+	ns = run(ws, 2 * npairs);
+	report(nonblock ? "pipe-nb" : "pipe", "write", bs, 0, npairs, ws, npairs,
+			per * npairs, ns);
+	report(nonblock ? "pipe-nb" : "pipe", "read", bs, 0, npairs, ws + npairs, npairs,
+			per * npairs, ns);
 
-	return 0;	
+	for (i = 0; i < 2 * npairs; i++) {
+		if (ws[i].fd != -1) {
+			close(ws[i].fd);
+		}
+	}
+	free_workers(ws, 2 * npairs);
 }
 
+int main(int argc, char **argv) {
+	char *csvname = NULL;
+	int b, q, j, c;
+
+	while ((c = getopt(argc, argv, "n:b:q:j:s:d:p:o:")) != -1) {
+		switch (c) {
+		case 'n':
+			total = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			parse_list(&bsizes, optarg);
+			break;
+		case 'q':
+			parse_list(&quanta, optarg);
+			break;
+		case 'j':
+			parse_list(&threads, optarg);
+			break;
+		case 's':
+			suites = optarg;
+			break;
+		case 'd':
+			sdev = optarg;
+			break;
+		case 'p':
+			pdev = optarg;
+			break;
+		case 'o':
+			csvname = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n bytes] [-b sizes] [-q quanta] [-j threads]\n"
+					"\t[-s seq,rand,pipe] [-d scull] [-p scullpipe] [-o csv]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+
+	if (csvname) {
+		if (!(csv = fopen(csvname, "w"))) {
+			perror(csvname);
+			return 1;
+		}
+		fprintf(csv, "test,op,bs,quantum,threads,bytes,secs,mbps,iops,"
+				"p50_us,p90_us,p99_us,p999_us,max_us\n");
+	}
+	printf("%-9s %-5s %8s %6s %3s %10s %10s %9s %9s %9s %9s %10s\n",
+			"test", "op", "bs", "quant", "thr", "MB/s", "ops/s",
+			"p50(us)", "p90", "p99", "p99.9", "max");
+
+	for (b = 0; b < bsizes.n; b++) {
+		for (q = 0; q < quanta.n; q++) {
+			for (j = 0; j < threads.n; j++) {
+				if (strstr(suites, "seq")) {
+					bench_scull(0, bsizes.v[b], quanta.v[q], threads.v[j]);
+				}
+				if (strstr(suites, "rand")) {
+					bench_scull(1, bsizes.v[b], quanta.v[q], threads.v[j]);
+				}
+			}
+		}
+		for (j = 0; j < threads.n && strstr(suites, "pipe"); j++) {
+			bench_pipe(0, bsizes.v[b], threads.v[j]);
+			bench_pipe(1, bsizes.v[b], threads.v[j]);
+		}
+	}
+
+	if (csv) {
+		fclose(csv);
+	}
+	return 0;
+}
@@ -8,21 +8,57 @@
 #include <linux/errno.h>  /* error codes */
 #include <linux/types.h>  /* size_t */
 #include <linux/interrupt.h> /* mark_bh */
+#include <linux/cpumask.h>
+#include <linux/ptr_ring.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ethtool.h>
+#include <linux/log2.h>
+#include <linux/rhashtable.h>
+#include <linux/rculist.h>
+#include <linux/hrtimer.h>
+#include <linux/prandom.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
 
 #include <linux/in.h>
 #include <linux/netdevice.h>   /* struct device, and other headers */
 #include <linux/etherdevice.h> /* eth_type_trans */
+#include <linux/if_vlan.h>     /* vlan_features_check() */
 #include <linux/ip.h>          /* struct iphdr */
 #include <linux/tcp.h>         /* struct tcphdr */
+#include <linux/udp.h>
 #include <linux/skbuff.h>
 
 #include <linux/in6.h>
 #include <asm/checksum.h>
+#include <net/checksum.h>
+#include <net/rtnetlink.h>
+#include <net/xdp.h>
+#include <net/page_pool.h>
 
 // These are the flags in the statusword
 #define SNULL_RX_INTR	0x0001
 #define SNULL_TX_INTR	0x0002
 
+// Largest MTU, for jumbo frames
+#define SNULL_MAX_MTU	9000
+
+// Headroom in front of a received frame, for XDP programs and with
+// the IP header aligned, and the largest MTU whose frames fit in a
+// page with it and the skb_shared_info
+#define SNULL_XDP_HEADROOM	(XDP_PACKET_HEADROOM + NET_IP_ALIGN)
+#define SNULL_XDP_MAX_MTU	(PAGE_SIZE - SNULL_XDP_HEADROOM - ETH_HLEN - \
+				SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
+// The delay line of the emulated link: a hashed timing wheel of
+// 1024 slots of 2^19 ns (524us), so half a second ahead before it
+// wraps. Later frames just wait for the wheel to come round. The
+// timer fires at most once per 16us: frames due in between go out
+// together, up to that much late.
+#define SNULL_WHEEL_SLOTS	1024
+#define SNULL_WHEEL_SHIFT	19
+#define SNULL_WHEEL_SLACK	(16 * NSEC_PER_USEC)
+
 // Default timeout period
 #define SNULL_TIMEOUT	5	// In jiffies
 
@@ -31,145 +67,631 @@ static int lockup = 0;
 
 static int timeout = SNULL_TIMEOUT;
 
-// The devices
+MODULE_LICENSE("GPL");
+
+// Receive through NAPI polling instead of one interrupt per packet
+static int use_napi = 0;
+module_param(use_napi, int, 0);
+
+// Packets per NAPI poll
+static int napi_weight = NAPI_POLL_WEIGHT;
+module_param(napi_weight, int, 0);
+
+// TX/RX queue pairs per device, 0 for one per CPU
+static int queues = 0;
+module_param(queues, int, 0);
+
+// Hand the skb itself to the twin instead of copying the frame
+static int zerocopy = 1;
+module_param(zerocopy, int, 0);
+
+// Packet descriptors per TX queue: how many packets a queue can
+// have in flight before the stack is told to hold off
+static int pool_size = 64;
+module_param(pool_size, int, 0);
+
+// The twins, created at load time
 struct net_device *snull_devs[2];
 
-// A structure representing an in-flight packet.
+// How a device forwards what it sends: to its twin, rewriting the
+// addresses on the way, or, for ports created with "ip link add type
+// snull", to whichever port of the mesh owns the destination MAC
+enum snull_mode {
+	SNULL_TWIN,
+	SNULL_MESH,
+};
+
+// The mesh: running ports, hashed by MAC and in a list for flooding.
+// Both change under the RTNL and are read under RCU.
+static struct rhashtable snull_fdb;
+static LIST_HEAD(snull_ports);
+
+// Queues per device, from the queues parameter
+static int snull_nqueues;
+
+struct snull_queue;
+
+// Buckets of the NAPI histogram: polls that received 0, 1, 2-3, 4-7,
+// ..., 32-63 and 64 or more packets
+#define SNULL_NAPI_BUCKETS	8
+
+// Counters of the receive half of a queue. They are only written by
+// its NAPI poll, or with q->lock held, and read through syncp.
+struct snull_rx_stats {
+	u64 packets;
+	u64 bytes;
+	u64 dropped;
+	u64 napi_hist[SNULL_NAPI_BUCKETS];
+	u64 xdp_drop;		// XDP verdicts, other than XDP_PASS
+	u64 xdp_tx;
+	u64 xdp_redirect;
+	struct u64_stats_sync syncp;
+};
+
+// ... and of the transmit half, only written with the TX queue locked
+struct snull_tx_stats {
+	u64 packets;
+	u64 bytes;
+	u64 dropped;
+	u64 errors;
+	u64 pool_empty;		// times the queue ran out of descriptors
+	u64 link_lost;		// lost on the emulated link
+	u64 doorbells;		// TX completions asked for
+	struct u64_stats_sync syncp;
+};
+
+#define snull_stats_add(s, field, n) do { \
+	u64_stats_update_begin(&(s)->syncp); \
+	(s)->field += (n); \
+	u64_stats_update_end(&(s)->syncp); \
+} while (0)
+
+// A structure representing an in-flight packet: a descriptor that
+// carries either a copy of the frame in data[] or, in zerocopy mode,
+// the skb or XDP frame itself.
 struct snull_packet {
-	struct snull_packet *next;
-	struct net_device *dev;
+	struct snull_queue *q;		// the queue whose pool it belongs to
+	struct sk_buff *skb;
+	struct xdp_frame *xdpf;
 	int datalen;
-	u8 data[ETH_DATA_LEN];
+	u32 hash;
+	enum pkt_hash_types hash_type;
+	struct snull_packet *next;	// on the delay line: the next one in the slot,
+	struct snull_queue *rxq;	// where it is going
+	u64 due;			// and when it gets there
+	u8 data[];
 };
 
-int pool_size = 8;
+// The delay line of a TX queue. Each slot keeps its frames sorted by
+// due time, so its head is the earliest; the timer is armed for the
+// earliest of all, but no sooner than the slack after its last run.
+struct snull_wheel {
+	spinlock_t lock;
+	struct hrtimer timer;
+	u64 clock;		// granule up to which slots have been run
+	u64 next;		// when the timer fires, U64_MAX if idle
+	u64 fired;		// when it last ran
+	DECLARE_BITMAP(pending, SNULL_WHEEL_SLOTS);
+	struct snull_packet *head[SNULL_WHEEL_SLOTS];
+	struct snull_packet *tail[SNULL_WHEEL_SLOTS];
+};
+
+// One TX/RX queue pair. Each has its own lock, packet pool and
+// "interrupt", like the queue vectors of a multi-queue NIC, so
+// CPUs transmitting on different queues never share a lock.
+//
+// Both the pool of free descriptors and the receive queue are
+// ptr_rings: FIFO, with separate producer and consumer locks. The
+// consumers are serialized already (the pool by the TX queue lock,
+// the receive queue by NAPI or q->lock), so they take no lock at all.
+struct snull_queue {
+	spinlock_t lock;
+	struct net_device *dev;
+	int index;
+	int status;
+	struct ptr_ring pool;		// free descriptors, for our TX
+	struct ptr_ring rx_ring;	// descriptors received from the twin
+	struct snull_packet **descs;	// TX scratch, pool_size entries
+	int rx_int_enabled;
+	struct sk_buff_head tx_done;	// sent, freed at the next TX completion
+	unsigned int tx_done_pkts;	// BQL: handed to us since the last one
+	unsigned int tx_done_bytes;
+	struct snull_wheel *wheel;	// allocated when link emulation is first set
+	struct napi_struct napi;
+	struct page_pool *page_pool;	// RX buffers, recycled
+	struct xdp_rxq_info xdp_rxq;
+	bool xdp_flush;			// redirected frames to flush after the poll
+	struct snull_rx_stats rx_stats;
+	struct snull_tx_stats tx_stats;
+	atomic64_t rx_fifo_errors;	// bumped by any sender
+} ____cacheline_aligned_in_smp;
 
 // This structure is private to each device. It is used to pass
 // packets in and out, so there is place for a packet
 struct snull_priv {
-	struct net_device_stats	stats;
-	int status;
-	struct snull_packet *ppool;
-	struct snull_packet *rx_queue;	// List of incoming packets
-	int rx_int_enabled;
-	int tx_packetlen;
-	u8 *tx_packetdata;
-	struct sk_buff *skb;
-	spinlock_t lock;
+	struct net_device *dev;
+	enum snull_mode mode;
+	struct net_device __rcu *peer;	// the twin
+	u8 mac[ETH_ALEN];		// key in snull_fdb
+	struct rhash_head node;
+	struct list_head port;		// on snull_ports
+	struct bpf_prog __rcu *xdp_prog;
+	struct snull_link {		// emulated link, set through sysfs
+		u64 rate;		// bit/s, 0 for no limit
+		u64 delay;		// one-way, in ns
+		u32 jitter;		// +/- ns, uniform, up to S32_MAX
+		u32 loss;		// parts per million
+		int active;		// any of the above set
+		atomic64_t free;	// when the wire is done with what is on it
+	} link;
+	int nqueues;
+	struct snull_queue q[];
 };
 
-static void snull_tx_timeout(struct net_device *dev);
+static const struct rhashtable_params snull_fdb_params = {
+	.key_len		= ETH_ALEN,
+	.key_offset		= offsetof(struct snull_priv, mac),
+	.head_offset		= offsetof(struct snull_priv, node),
+	.automatic_shrinking	= true,
+};
+
+static void snull_tx_timeout(struct net_device *dev, unsigned int txqueue);
 static void (*snull_interrupt)(int, void *, struct pt_regs *);
-void snull_rx(struct net_device *dev, struct snull_packet *pkt);
+void snull_rx(struct snull_queue *q, struct snull_packet *pkt);
+
+// Free what a zerocopy descriptor still carries
+static void snull_free_payload(struct snull_packet *pkt) {
+	kfree_skb(pkt->skb);
+	pkt->skb = NULL;
+	if (pkt->xdpf) {
+		xdp_return_frame(pkt->xdpf);
+		pkt->xdpf = NULL;
+	}
+}
 
-// Set up a device's packet pool
-void snull_setup_pool(struct net_device *dev) {
-	struct snull_priv *priv = netdev_priv(dev);
+static void snull_free_packet(void *ptr) {
+	struct snull_packet *pkt = ptr;
+
+	snull_free_payload(pkt);
+	kfree(pkt);
+}
+
+// Set up a queue's packet pool and receive ring. The receive ring has
+// room for every descriptor the twin owns, so it can never overflow.
+int snull_setup_pool(struct snull_queue *q, int nqueues) {
 	int i;
 	struct snull_packet *pkt;
+	size_t size = sizeof(struct snull_packet);
 
-	priv->ppool = NULL;
+	if (!zerocopy) {
+		size += ETH_HLEN + SNULL_MAX_MTU;
+	}
+	q->descs = kcalloc(pool_size, sizeof(*q->descs), GFP_KERNEL);
+	if (!q->descs || ptr_ring_init(&q->pool, pool_size, GFP_KERNEL) ||
+			ptr_ring_init(&q->rx_ring, pool_size * nqueues, GFP_KERNEL)) {
+		return -ENOMEM;
+	}
 	for (i = 0; i < pool_size; i++) {
-		pkt = kmalloc(sizeof (struct snull_packet), GFP_KERNEL);
+		pkt = kzalloc(size, GFP_KERNEL);
 		if (pkt == NULL) {
 			printk(KERN_NOTICE "Ran out of memory allocating packet pool\n");
-			return;
+			return -ENOMEM;
 		}
-		pkt->dev = dev;
-		pkt->next = priv->ppool;
-		priv->ppool = pkt;
+		pkt->q = q;
+		__ptr_ring_produce(&q->pool, pkt);
 	}
+	return 0;
 }
 
+// Free the pools. This is the priv_destructor, run once the device is
+// unregistered and every descriptor it lent out has come back (each
+// holds a reference to it); snull_dev_init() also calls it to undo a
+// half-done setup.
 void snull_teardown_pool(struct net_device *dev) {
 	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
+	struct snull_queue *q;
+	int i;
 
-	while((pkt = priv->ppool)) {
-		priv->ppool = pkt->next;
-		kfree(pkt);
+	for (i = 0; i < priv->nqueues; i++) {
+		q = &priv->q[i];
+		if (q->pool.queue) {
+			ptr_ring_cleanup(&q->pool, snull_free_packet);
+		}
+		if (q->rx_ring.queue) {
+			ptr_ring_cleanup(&q->rx_ring, snull_free_packet);
+		}
+		if (xdp_rxq_info_is_reg(&q->xdp_rxq)) {
+			xdp_rxq_info_unreg(&q->xdp_rxq);
+		}
+		// Waits, in the background, for pages still out in skbs
+		if (q->page_pool) {
+			page_pool_destroy(q->page_pool);
+			q->page_pool = NULL;
+		}
+		if (q->wheel) {
+			hrtimer_cancel(&q->wheel->timer);
+			kfree(q->wheel);
+			q->wheel = NULL;
+		}
+		kfree(q->descs);
+		q->descs = NULL;
 	}
 }
 
-// Buffer/pool management
-struct snull_packet *snull_get_tx_buffer(struct net_device *dev) {
-	struct snull_priv *priv = netdev_priv(dev);
-	unsigned long flags;
-	struct snull_packet *pkt;
+// Buffer/pool management. Called with the TX queue locked, so we are
+// the only consumer of the pool. Takes n descriptors or none.
+static int snull_get_tx_buffers(struct snull_queue *q, int n) {
+	int got = __ptr_ring_consume_batched(&q->pool, (void **)q->descs, n);
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->ppool;
-	priv->ppool = pkt->next;
-	if (priv->ppool == NULL) {
-			printk("Pool empty\n");
-			netif_stop_queue(dev);
+	if (got < n) {
+		while (got) {
+			ptr_ring_produce(&q->pool, q->descs[--got]);
+		}
+		return -ENOBUFS;
 	}
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+	return 0;
 }
 
+// Return a descriptor to the pool of the queue that sent it, and let
+// that queue transmit again if it was held off waiting for one
 void snull_release_buffer(struct snull_packet *pkt) {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(pkt->dev);
+	struct snull_queue *q = pkt->q;
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+
+	pkt->skb = NULL;
+	pkt->xdpf = NULL;
+	ptr_ring_produce(&q->pool, pkt);	// the ring holds the whole pool
+	smp_mb();	// pairs with snull_tx_stop()
+	if (netif_tx_queue_stopped(txq)) {
+		netif_tx_wake_queue(txq);
+	}
+}
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->ppool;
-	priv->ppool = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	if (netif_queue_stopped(pkt->dev) && pkt->next == NULL) {
-		netif_wake_queue(pkt->dev);
+// Stop the TX queue when its pool is empty. Recheck after stopping,
+// since a descriptor returned in between would not have woken us.
+static void snull_tx_stop(struct snull_queue *q, struct netdev_queue *txq) {
+	netif_tx_stop_queue(txq);
+	smp_mb();
+	if (!__ptr_ring_empty(&q->pool)) {
+		netif_tx_start_queue(txq);
 	}
 }
 
-void snull_enqueue_buf(struct net_device *dev, struct snull_packet *pkt) {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(dev);
+// Put a descriptor on the receive queue, and "interrupt" if allowed.
+// The receiving device holds a reference on the sender until it is
+// done with the descriptor, as it has to give it back.
+static int snull_enqueue_buf(struct snull_queue *q, struct snull_packet *pkt) {
+	if (!netif_running(q->dev)) {
+		return -ENETDOWN;
+	}
+	dev_hold(pkt->q->dev);
+	if (ptr_ring_produce(&q->rx_ring, pkt)) {
+		dev_put(pkt->q->dev);
+		atomic64_inc(&q->rx_fifo_errors);
+		return -ENOBUFS;
+	}
+	smp_mb();	// pairs with snull_poll() unmasking interrupts
+	if (q->rx_int_enabled) {
+		// Other senders, and the TX doorbell, raise it too
+		spin_lock(&q->lock);
+		q->status |= SNULL_RX_INTR;
+		spin_unlock(&q->lock);
+		snull_interrupt(0, q, NULL);
+	}
+	return 0;
+}
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->rx_queue;
-	priv->rx_queue = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+// Done with a received descriptor: back to the sender's pool, and
+// let go of the sender. Whatever the receive path did not take from
+// it is freed.
+static void snull_recycle(struct snull_packet *pkt) {
+	struct net_device *owner = pkt->q->dev;
+
+	snull_free_payload(pkt);
+	snull_release_buffer(pkt);
+	dev_put(owner);
 }
 
-struct snull_packet *snull_dequeue_buf(struct net_device *dev) {
-	struct snull_priv *priv = netdev_priv(dev);
+// Drop whatever is waiting on a receive queue of a device going down.
+// The pools it recycles into are also fed from softirqs, which must
+// not get in while we hold their producer locks.
+static void snull_purge_rx(struct snull_queue *q) {
 	struct snull_packet *pkt;
-	unsigned long flags;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->rx_queue;
-	if (pkt != NULL) {
-		priv->rx_queue = pkt->next;
+	local_bh_disable();
+	while ((pkt = __ptr_ring_consume(&q->rx_ring))) {
+		snull_recycle(pkt);
+	}
+	local_bh_enable();
+}
+
+
+// When the wheel has to fire next: the earliest due time, looking
+// at the heads of the slots in order from the clock on. Once a slot
+// has a frame for this turn of the wheel, the slots after it can't
+// beat it.
+static u64 snull_wheel_next(struct snull_wheel *w) {
+	u64 g, next = U64_MAX;
+	int slot, i;
+
+	for (i = 0; i < SNULL_WHEEL_SLOTS; i++) {
+		g = w->clock + i;
+		slot = g & (SNULL_WHEEL_SLOTS - 1);
+		if (!test_bit(slot, w->pending)) {
+			continue;
+		}
+		next = min(next, w->head[slot]->due);
+		if ((next >> SNULL_WHEEL_SHIFT) <= g) {
+			break;
+		}
+	}
+	return next;
+}
+
+// Arm the timer for due, or for the end of the slack if that is
+// later, unless it already fires sooner
+static void snull_wheel_arm(struct snull_wheel *w, u64 due) {
+	due = max(due, w->fired + SNULL_WHEEL_SLACK);
+	if (due < w->next) {
+		w->next = due;
+		hrtimer_start(&w->timer, ns_to_ktime(due), HRTIMER_MODE_ABS_SOFT);
 	}
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+}
+
+// The wheel's timer: take out every frame that is due, from the slots
+// between the last run and now, rearm, and only then deliver them.
+static enum hrtimer_restart snull_wheel_fire(struct hrtimer *timer) {
+	struct snull_wheel *w = container_of(timer, struct snull_wheel, timer);
+	struct snull_packet *pkt, *ready = NULL, **tail = &ready;
+	struct net_device *dest;
+	u64 now = ktime_get_ns(), g, next;
+	int slot;
+
+	spin_lock(&w->lock);
+	for (g = w->clock; g <= (now >> SNULL_WHEEL_SHIFT) &&
+			g < w->clock + SNULL_WHEEL_SLOTS; g++) {
+		slot = g & (SNULL_WHEEL_SLOTS - 1);
+		if (!test_bit(slot, w->pending)) {
+			continue;
+		}
+		// Sorted: the due frames are a prefix of the slot
+		while ((pkt = w->head[slot]) && pkt->due <= now) {
+			w->head[slot] = pkt->next;
+			*tail = pkt;
+			tail = &pkt->next;
+		}
+		if (!w->head[slot]) {
+			w->tail[slot] = NULL;
+			clear_bit(slot, w->pending);
+		}
+	}
+	*tail = NULL;
+	w->clock = now >> SNULL_WHEEL_SHIFT;
+	w->fired = now;
+	w->next = U64_MAX;
+	next = snull_wheel_next(w);
+	if (next != U64_MAX) {
+		snull_wheel_arm(w, next);
+	}
+	spin_unlock(&w->lock);
+
+	while ((pkt = ready)) {
+		ready = pkt->next;
+		dest = pkt->rxq->dev;
+		if (snull_enqueue_buf(pkt->rxq, pkt)) {
+			snull_free_payload(pkt);
+			snull_release_buffer(pkt);
+		}
+		dev_put(dest);
+	}
+	return HRTIMER_NORESTART;
+}
+
+// Put a frame on q's delay line, to reach rxq at due. Frames almost
+// always come in due order and go at the tail; jitter makes the rest
+// look for their place.
+static void snull_wheel_add(struct snull_wheel *w, struct snull_queue *rxq,
+				struct snull_packet *pkt, u64 due) {
+	struct snull_packet **pp;
+	int slot;
+
+	dev_hold(rxq->dev);	// until the frame is off the wheel
+	pkt->rxq = rxq;
+
+	spin_lock(&w->lock);
+	// The timer may have run the slots past due since it was computed:
+	// a frame behind the clock would not be seen for a whole turn
+	due = max(due, w->clock << SNULL_WHEEL_SHIFT);
+	slot = (due >> SNULL_WHEEL_SHIFT) & (SNULL_WHEEL_SLOTS - 1);
+	pkt->due = due;
+	if (!w->tail[slot] || w->tail[slot]->due <= due) {
+		pkt->next = NULL;
+		if (w->tail[slot]) {
+			w->tail[slot]->next = pkt;
+		} else {
+			w->head[slot] = pkt;
+			set_bit(slot, w->pending);
+		}
+		w->tail[slot] = pkt;
+	} else {
+		for (pp = &w->head[slot]; (*pp)->due <= due; pp = &(*pp)->next)
+			;
+		pkt->next = *pp;
+		*pp = pkt;
+	}
+	snull_wheel_arm(w, due);
+	spin_unlock(&w->lock);
+}
+
+// Drop whatever is still on the delay line of a device going down
+static void snull_wheel_purge(struct snull_wheel *w) {
+	struct snull_packet *pkt;
+	int slot;
+
+	hrtimer_cancel(&w->timer);
+	spin_lock_bh(&w->lock);
+	for_each_set_bit(slot, w->pending, SNULL_WHEEL_SLOTS) {
+		while ((pkt = w->head[slot])) {
+			w->head[slot] = pkt->next;
+			dev_put(pkt->rxq->dev);
+			snull_free_payload(pkt);
+			snull_release_buffer(pkt);
+		}
+		w->tail[slot] = NULL;
+	}
+	bitmap_zero(w->pending, SNULL_WHEEL_SLOTS);
+	w->next = U64_MAX;
+	spin_unlock_bh(&w->lock);
+}
+
+// The emulated link from the TX queue q to rxq, which the frame of
+// len bytes in pkt is bound for. It may be lost, as on a real wire,
+// which counts as sent; otherwise it waits its turn on the wire (the
+// rate is for the whole device, whatever the queue) and then the
+// delay, give or take the jitter, on q's wheel. Without emulation,
+// straight to snull_enqueue_buf(), which has the same contract.
+static int snull_link_send(struct snull_queue *q, struct snull_queue *rxq,
+				struct snull_packet *pkt, int len) {
+	struct snull_link *link = &((struct snull_priv *)netdev_priv(q->dev))->link;
+	u64 now, due, start, rate, tx_ns;
+	u32 loss, jitter;
+
+	if (!smp_load_acquire(&link->active)) {
+		return snull_enqueue_buf(rxq, pkt);
+	}
+
+	loss = READ_ONCE(link->loss);
+	if (loss && prandom_u32_max(1000000) < loss) {
+		snull_stats_add(&q->tx_stats, link_lost, 1);
+		snull_free_payload(pkt);
+		snull_release_buffer(pkt);
+		return 0;
+	}
+
+	now = ktime_get_ns();
+	due = now;
+	rate = READ_ONCE(link->rate);
+	if (rate) {
+		tx_ns = div64_u64((u64)len * 8 * NSEC_PER_SEC, rate);
+		do {
+			start = atomic64_read(&link->free);
+			due = max(start, now) + tx_ns;
+		} while (atomic64_cmpxchg(&link->free, start, due) != start);
+	}
+	due += READ_ONCE(link->delay);
+	jitter = READ_ONCE(link->jitter);
+	if (jitter) {
+		due += prandom_u32_max(2 * jitter + 1);
+		due = due > now + jitter ? due - jitter : now;
+	}
+
+	snull_wheel_add(q->wheel, rxq, pkt, due);
+	return 0;
 }
 
 // Enable and disable receive interrupts
-static void snull_rx_ints(struct net_device *dev, int enable) {
-	struct snull_priv *priv = netdev_priv(dev);
-	priv->rx_int_enabled = enable;
+static void snull_rx_ints(struct snull_queue *q, int enable) {
+	q->rx_int_enabled = enable;
+}
+
+// TX completion: free in one batch what went out since the last one,
+// and tell BQL how much has left the queue
+static void snull_tx_reap(struct snull_queue *q, int budget) {
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+	struct sk_buff_head done;
+	unsigned int pkts, bytes;
+	struct sk_buff *skb;
+
+	__skb_queue_head_init(&done);
+	spin_lock(&q->lock);
+	skb_queue_splice_init(&q->tx_done, &done);
+	pkts = q->tx_done_pkts;
+	bytes = q->tx_done_bytes;
+	q->tx_done_pkts = 0;
+	q->tx_done_bytes = 0;
+	spin_unlock(&q->lock);
+
+	while ((skb = __skb_dequeue(&done))) {
+		napi_consume_skb(skb, budget);
+	}
+	if (pkts) {
+		netdev_tx_completed_queue(txq, pkts, bytes);
+	}
+}
+
+// Ring the TX doorbell: ask for a completion of everything sent so
+// far. Called with the TX queue locked.
+static void snull_tx_kick(struct snull_queue *q) {
+	snull_stats_add(&q->tx_stats, doorbells, 1);
+	spin_lock(&q->lock);
+	q->status |= SNULL_TX_INTR;
+	spin_unlock(&q->lock);
+	snull_interrupt(0, q, NULL);
 }
 
 // Open and close
 int snull_open(struct net_device *dev) {
+	struct snull_priv *priv = netdev_priv(dev);
+	int i, err;
+
 	// request_region(), request_irq(), ... (like fops->open)
 
-	// Assign the hardware address of the board: use "\0SNULx", where
-	// x is 0 or 1. The first byte is '\0' to avoid being a multicast
-	// address (the first byte of multicast addrs is odd).
-	memcpy(dev->dev_addr, "\0SNUL0", ETH_ALEN);
-	if (dev == snull_devs[1]) {
-		dev->dev_addr[ETH_ALEN - 1]++;	//\0SNUL1
+	if (priv->mode == SNULL_TWIN) {
+		// Assign the hardware address of the board: use "\0SNULx", where
+		// x is 0 or 1. The first byte is '\0' to avoid being a multicast
+		// address (the first byte of multicast addrs is odd).
+		memcpy(dev->dev_addr, "\0SNUL0", ETH_ALEN);
+		if (dev == snull_devs[1]) {
+			dev->dev_addr[ETH_ALEN - 1]++;	//\0SNUL1
+		}
+	} else {
+		// Join the mesh. Two ports can't share an address.
+		memcpy(priv->mac, dev->dev_addr, ETH_ALEN);
+		err = rhashtable_lookup_insert_fast(&snull_fdb, &priv->node,
+				snull_fdb_params);
+		if (err) {
+			return err;
+		}
+		list_add_tail_rcu(&priv->port, &snull_ports);
 	}
-	netif_start_queue(dev);
+	if (use_napi) {
+		for (i = 0; i < priv->nqueues; i++) {
+			napi_enable(&priv->q[i].napi);
+		}
+	}
+	netif_tx_start_all_queues(dev);
 	return 0;
 }
 
 int snull_release(struct net_device *dev) {
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
 	// release ports, irq and such -- like fops->close
 
-	netif_stop_queue(dev);	// can't transmit any more
+	netif_tx_stop_all_queues(dev);	// can't transmit any more
+	if (priv->mode == SNULL_MESH) {
+		rhashtable_remove_fast(&snull_fdb, &priv->node, snull_fdb_params);
+		list_del_rcu(&priv->port);
+	}
+	if (use_napi) {
+		for (i = 0; i < priv->nqueues; i++) {
+			napi_disable(&priv->q[i].napi);
+		}
+	}
+	// The core has waited out any sender that saw us running, and
+	// new ones find us down: give back what is still queued, and
+	// what we sent that is still on the wire
+	for (i = 0; i < priv->nqueues; i++) {
+		snull_purge_rx(&priv->q[i]);
+		if (priv->q[i].wheel) {
+			snull_wheel_purge(priv->q[i].wheel);
+		}
+		local_bh_disable();
+		snull_tx_reap(&priv->q[i], 0);
+		local_bh_enable();
+		netdev_tx_reset_queue(netdev_get_tx_queue(dev, i));
+	}
 	return 0;
 }
 
@@ -178,78 +700,344 @@ int snull_config(struct net_device *dev, struct ifmap *map) {
 	return 0;
 }
 
-// The typical interrupt entry point
+// The typical interrupt entry point. Every queue has its own
+// "vector", dev_id is the queue.
 static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs) {
 	int statusword;
-	struct snull_priv *priv;
-	struct snull_packet *pkt = NULL;
-
-	// As usual, check the "device" pointer to be sure it is
-	// really interrupting.
-	// Then assign "struct device *dev" 
-	struct net_device *dev = (struct net_device *)dev_id;
-	// ... and check with hw if it's really ours
+	struct snull_queue *q = dev_id;
+	struct snull_packet *pkt;
 
 	// paranoid
-	if (!dev) {
+	if (!q) {
 		return;
 	}
 
-	// Lock the device
-	priv = netdev_priv(dev);
-	spin_lock(&priv->lock);
+	// Lock the queue
+	spin_lock(&q->lock);
 
 	// retrieve statusword: real netdevices use I/O instructions
-	statusword = priv->status;
-	priv->status = 0;
+	statusword = q->status;
+	q->status = 0;
 	if (statusword & SNULL_RX_INTR) {
-		// send it to snull_rx for handling
-		pkt = priv->rx_queue;
-		if (pkt) {
-			priv->rx_queue = pkt->next;
-			snull_rx(dev, pkt);
+		// Several senders may share one interrupt: send all that
+		// is queued to snull_rx for handling
+		while ((pkt = __ptr_ring_consume(&q->rx_ring))) {
+			snull_rx(q, pkt);
+			spin_unlock(&q->lock);
+			snull_recycle(pkt);	// Do this outside the lock
+			spin_lock(&q->lock);
 		}
 	}
+
+	// Unlock the queue and we are done
+	spin_unlock(&q->lock);
 	if (statusword & SNULL_TX_INTR) {
-		// a transmission is over: free the skb
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
+		// transmissions are over: free the skbs
+		snull_tx_reap(q, 0);
+	}
+
+	return;
+}
+
+// The NAPI interrupt: an RX interrupt only masks further RX interrupts
+// and schedules the poll, which does the actual receiving. TX
+// completions are left to the poll too.
+static void snull_napi_interrupt(int irq, void *dev_id, struct pt_regs *regs) {
+	int statusword;
+	struct snull_queue *q = dev_id;
+
+	if (!q) {
+		return;
 	}
 
-	// Unlock the device and we are done
-	spin_unlock(&priv->lock);
-	if (pkt) {
-		snull_release_buffer(pkt);	// Do this outside the lock
+	spin_lock(&q->lock);
+
+	statusword = q->status;
+	q->status = 0;
+	if (statusword & SNULL_RX_INTR) {
+		snull_rx_ints(q, 0);	// disable further interrupts
+		napi_schedule(&q->napi);
+	}
+	if (statusword & SNULL_TX_INTR) {
+		napi_schedule(&q->napi);
 	}
 
+	spin_unlock(&q->lock);
 	return;
 }
 
+static int snull_xdp_xmit_queue(struct snull_queue *q, int n, struct xdp_frame **frames);
+
+// Whether a frame of len bytes fits in a page of the RX page_pool,
+// with the headroom in front and the skb_shared_info after it
+#define SNULL_RX_FITS(len)	(SKB_DATA_ALIGN(SNULL_XDP_HEADROOM + (len)) + \
+				SKB_DATA_ALIGN(sizeof(struct skb_shared_info)) <= PAGE_SIZE)
+
+// "DMA" a received frame into a page of the queue's page_pool,
+// SNULL_XDP_HEADROOM in: the copy in the descriptor or, zerocopy, the
+// skb or XDP frame it carries, which is freed then. The allocations
+// are serialized by NAPI, or by q->lock in the interrupt.
+static struct page *snull_rx_page(struct snull_queue *q, struct snull_packet *pkt) {
+	struct page *page = page_pool_dev_alloc_pages(q->page_pool);
+	u8 *buf;
+
+	if (!page) {
+		return NULL;
+	}
+	buf = page_address(page) + SNULL_XDP_HEADROOM;
+	if (pkt->skb) {
+		skb_push(pkt->skb, ETH_HLEN);	// undo eth_type_trans()
+		skb_copy_and_csum_dev(pkt->skb, buf);
+		consume_skb(pkt->skb);
+		pkt->skb = NULL;
+	} else if (pkt->xdpf) {
+		memcpy(buf, pkt->xdpf->data, pkt->xdpf->len);
+		memset(buf + pkt->xdpf->len, 0, pkt->datalen - pkt->xdpf->len);
+		xdp_return_frame(pkt->xdpf);
+		pkt->xdpf = NULL;
+	} else {
+		memcpy(buf, pkt->data, pkt->datalen);
+	}
+	return page;
+}
+
+// Build an skb around a page_pool page holding len bytes of frame at
+// data. The page goes back to the pool when the stack frees the skb.
+static struct sk_buff *snull_build_skb(struct snull_queue *q, struct page *page,
+				void *data, int len, int metalen) {
+	struct sk_buff *skb = build_skb(page_address(page), PAGE_SIZE);
+
+	if (!skb) {
+		page_pool_put_full_page(q->page_pool, page, false);
+		return NULL;
+	}
+	skb_mark_for_recycle(skb);
+	skb_reserve(skb, data - page_address(page));
+	skb_put(skb, len);
+	if (metalen) {
+		skb_metadata_set(skb, metalen);
+	}
+	skb->protocol = eth_type_trans(skb, q->dev);
+	skb->ip_summed = CHECKSUM_UNNECESSARY;	// dont check it
+	return skb;
+}
+
+// Native XDP: the program runs on the frame in its page before any
+// skb exists. Only XDP_PASS gets an skb; the other verdicts end here,
+// and the page finds its own way back to the pool.
+static struct sk_buff *snull_rx_xdp(struct snull_queue *q, struct snull_packet *pkt,
+				struct bpf_prog *prog) {
+	struct net_device *dev = q->dev;
+	struct xdp_frame *xdpf;
+	struct xdp_buff xdp;
+	struct sk_buff *skb;
+	struct page *page;
+	u32 act;
+
+	// A jumbo frame from a mesh port, or a zerocopy super-packet
+	// that was on its way before the program came
+	if (!SNULL_RX_FITS(pkt->datalen) || (pkt->skb && skb_is_gso(pkt->skb))) {
+		goto drop;
+	}
+	page = snull_rx_page(q, pkt);
+	if (!page) {
+		goto drop;
+	}
+	xdp_init_buff(&xdp, PAGE_SIZE, &q->xdp_rxq);
+	xdp_prepare_buff(&xdp, page_address(page), SNULL_XDP_HEADROOM, pkt->datalen, true);
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+		skb = snull_build_skb(q, page, xdp.data, xdp.data_end - xdp.data,
+				xdp.data - xdp.data_meta);
+		if (!skb) {
+			goto drop;
+		}
+		return skb;
+	case XDP_TX:
+		xdpf = xdp_convert_buff_to_frame(&xdp);
+		if (!xdpf || snull_xdp_xmit_queue(q, 1, &xdpf) != 1) {
+			goto err;
+		}
+		snull_stats_add(&q->rx_stats, xdp_tx, 1);
+		return NULL;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(dev, &xdp, prog)) {
+			goto err;
+		}
+		q->xdp_flush = true;
+		snull_stats_add(&q->rx_stats, xdp_redirect, 1);
+		return NULL;
+	default:
+		bpf_warn_invalid_xdp_action(act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		page_pool_put_full_page(q->page_pool, page, true);
+		snull_stats_add(&q->rx_stats, xdp_drop, 1);
+		return NULL;
+	}
+
+err:
+	page_pool_put_full_page(q->page_pool, page, true);
+drop:
+	snull_stats_add(&q->rx_stats, dropped, 1);
+	return NULL;
+}
+
+// Turn a received descriptor into an skb: in zerocopy mode it is
+// the one the twin sent, otherwise build one around a copy in a page
+// of the page_pool. With an XDP program (NAPI only) the frame is
+// copied into a page whatever the mode, and goes through it first.
+static struct sk_buff *snull_rx_skb(struct snull_queue *q, struct snull_packet *pkt,
+				struct bpf_prog *prog) {
+	struct sk_buff *skb = pkt->skb;
+	struct net_device *dev = q->dev;
+	struct page *page;
+
+	if (skb && !prog) {
+		pkt->skb = NULL;
+	} else if (prog) {
+		skb = snull_rx_xdp(q, pkt, prog);
+		if (!skb) {
+			return NULL;
+		}
+	} else {
+		// The packet has been retrieved from the transmission
+		// medium. Build an skb around it, so upper layers can handle
+		// it. Jumbo frames don't fit a page, and get a buffer of
+		// their own.
+		if (SNULL_RX_FITS(pkt->datalen)) {
+			page = snull_rx_page(q, pkt);
+			skb = page ? snull_build_skb(q, page, page_address(page) +
+					SNULL_XDP_HEADROOM, pkt->datalen, 0) : NULL;
+		} else {
+			skb = netdev_alloc_skb_ip_align(dev, pkt->datalen);
+			if (skb) {
+				skb_put_data(skb, pkt->data, pkt->datalen);
+				skb->protocol = eth_type_trans(skb, dev);
+				skb->ip_summed = CHECKSUM_UNNECESSARY;
+			}
+		}
+		if (!skb) {
+			if (printk_ratelimit()) {
+				printk("snull rx: low on mem - packet dropped\n");
+			}
+			snull_stats_add(&q->rx_stats, dropped, 1);
+			return NULL;
+		}
+	}
+	skb_set_hash(skb, pkt->hash, pkt->hash_type);
+	skb_record_rx_queue(skb, q->index);
+	u64_stats_update_begin(&q->rx_stats.syncp);
+	q->rx_stats.packets++;
+	q->rx_stats.bytes += skb->len + ETH_HLEN;
+	u64_stats_update_end(&q->rx_stats.syncp);
+	return skb;
+}
+
+// The poll: receive up to budget packets, handing them to GRO
+static int snull_poll(struct napi_struct *napi, int budget) {
+	struct snull_queue *q = container_of(napi, struct snull_queue, napi);
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct snull_packet *pkt;
+	struct bpf_prog *prog;
+	struct sk_buff *skb;
+	int npackets = 0;
+
+	// TX completions first, the whole batch; they don't count
+	// against the budget
+	snull_tx_reap(q, budget);
+
+	rcu_read_lock();
+	prog = rcu_dereference(priv->xdp_prog);
+	while (npackets < budget && (pkt = __ptr_ring_consume(&q->rx_ring))) {
+		skb = snull_rx_skb(q, pkt, prog);
+		snull_recycle(pkt);
+		if (skb) {
+			napi_gro_receive(napi, skb);
+		}
+		npackets++;
+	}
+	if (q->xdp_flush) {
+		xdp_do_flush();
+		q->xdp_flush = false;
+	}
+	rcu_read_unlock();
+	snull_stats_add(&q->rx_stats,
+			napi_hist[npackets ? min(ilog2(npackets) + 1, SNULL_NAPI_BUCKETS - 1) : 0], 1);
+
+	// Queue drained: leave polling mode and unmask RX interrupts.
+	// A packet that arrived after the last dequeue found them
+	// masked and raised nothing, so look once more.
+	if (npackets < budget && napi_complete_done(napi, npackets)) {
+		snull_rx_ints(q, 1);
+		smp_mb();
+		if (!__ptr_ring_empty(&q->rx_ring)) {
+			snull_rx_ints(q, 0);
+			napi_schedule(napi);
+		}
+	}
+	return npackets;
+}
+
 // Ioctl commands
 int snull_ioctl(struct net_device *dev, struct ifreq *rq, int cmd) {
 	return 0;
 }
 
 // Deal with a transmit timeout
-void snull_tx_timeout(struct net_device *dev) {
+void snull_tx_timeout(struct net_device *dev, unsigned int txqueue) {
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = &priv->q[txqueue];
 
-	printk("Transmit timeout at %ld, latency %ld\n", jiffies,
-			jiffies - dev->trans_start);
+	printk("Transmit timeout on queue %u at %ld, latency %ld\n", txqueue,
+			jiffies, jiffies - dev_trans_start(dev));
 	// Simulate a transmission interrupt to get things move
-	priv->status = SNULL_TX_INTR;
-	snull_interrupt(0, dev, NULL);
-	priv->stats.tx_errors++;
-	netif_wake_queue(dev);
+	snull_tx_kick(q);
+	snull_stats_add(&q->tx_stats, errors, 1);
+	netif_tx_wake_queue(netdev_get_tx_queue(dev, txqueue));
 
 	return;
 }
 
-// Return statistics to the caller
-struct net_device_stats *snull_stats(struct net_device *dev) {
+// Return statistics to the caller, summed over the queues
+void snull_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *s) {
 	struct snull_priv *priv = netdev_priv(dev);
-	return &priv->stats;
+	u64 rx_packets, rx_bytes, rx_dropped;
+	u64 tx_packets, tx_bytes, tx_dropped, tx_errors;
+	struct snull_queue *q;
+	unsigned int start;
+	int i;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		q = &priv->q[i];
+		do {
+			start = u64_stats_fetch_begin(&q->rx_stats.syncp);
+			rx_packets = q->rx_stats.packets;
+			rx_bytes = q->rx_stats.bytes;
+			rx_dropped = q->rx_stats.dropped;
+		} while (u64_stats_fetch_retry(&q->rx_stats.syncp, start));
+		do {
+			start = u64_stats_fetch_begin(&q->tx_stats.syncp);
+			tx_packets = q->tx_stats.packets;
+			tx_bytes = q->tx_stats.bytes;
+			tx_dropped = q->tx_stats.dropped;
+			tx_errors = q->tx_stats.errors;
+		} while (u64_stats_fetch_retry(&q->tx_stats.syncp, start));
+
+		s->rx_packets += rx_packets;
+		s->rx_bytes += rx_bytes;
+		s->rx_dropped += rx_dropped;
+		s->rx_fifo_errors += atomic64_read(&q->rx_fifo_errors);
+		s->tx_packets += tx_packets;
+		s->tx_bytes += tx_bytes;
+		s->tx_dropped += tx_dropped;
+		s->tx_errors += tx_errors;
+	}
 }
 
 // This function is called to fill up an eth header, since arp
@@ -267,128 +1055,753 @@ int snull_header(struct sk_buff *skb, struct net_device *dev,
 }
 
 // Receive a packet: retrieve, encapsulate and pass over to upper levels
-void snull_rx(struct net_device *dev, struct snull_packet *pkt) {
+void snull_rx(struct snull_queue *q, struct snull_packet *pkt) {
 	struct sk_buff *skb;
-	struct snull_priv *priv = netdev_priv(dev);
 
-	// The packet has been retrieved from the transmission
-	// medium. Build an skb around it, so upper layers can handle it
-	skb = dev_alloc_skb(pkt->datalen + 2);
-	if (!skb) {
-		if (printk_ratelimit()) {
-			printk("snull rx: low on mem - packet dropped\n");
-			priv->stats.rx_dropped++;
-			goto out;
+	skb = snull_rx_skb(q, pkt, NULL);
+	if (skb) {
+		netif_rx(skb);
+	}
+}
+
+// Flip the third octet (class C) of both addresses. Both the header
+// checksum and the L4 one, which covers the addresses through the
+// pseudo-header, are fixed up incrementally (RFC 1624). Given the
+// skb, the L4 checksum may still be partial (left for "hardware"),
+// which inet_proto_csum_replace4() takes care of. len is how much
+// of the packet, from the IP header on, is there to look at.
+static void snull_flip_addrs(struct iphdr *ih, struct sk_buff *skb, int len) {
+	__sum16 *check = NULL;
+	int hlen = ih->ihl * 4, udp = 0;
+	u8 *l4 = (u8 *)ih + hlen;
+	__be32 *addr[2] = { &ih->saddr, &ih->daddr };
+	__be32 old;
+	int i;
+
+	if (!(ih->frag_off & htons(IP_OFFSET))) {
+		if (ih->protocol == IPPROTO_TCP && len >= hlen + sizeof(struct tcphdr)) {
+			check = &((struct tcphdr *)l4)->check;
+		} else if (ih->protocol == IPPROTO_UDP && len >= hlen + sizeof(struct udphdr)) {
+			check = &((struct udphdr *)l4)->check;
+			udp = !(skb && skb->ip_summed == CHECKSUM_PARTIAL);
+			if (udp && !*check) {
+				check = NULL;	// no checksum at all
+			}
 		}
 	}
-	skb_reserve(skb, 2);	// align IP on 16B boundary
-	memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
 
-	// Write metadata, and then pass to the receive level
-	skb->dev = dev;
-	skb->protocol = eth_type_trans(skb, dev);
-	skb->ip_summed = CHECKSUM_UNNECESSARY;	// dont check it
-	priv->stats.rx_packets++;
-	priv->stats.rx_bytes += pkt->datalen;
-	netif_rx(skb);
-out:
-	return;
+	for (i = 0; i < 2; i++) {
+		old = *addr[i];
+		((u8 *)addr[i])[2] ^= 1;
+		csum_replace4(&ih->check, old, *addr[i]);
+		if (!check) {
+			continue;
+		}
+		if (skb) {
+			inet_proto_csum_replace4(check, skb, old, *addr[i], true);
+		} else {
+			csum_replace4(check, old, *addr[i]);
+		}
+	}
+	if (udp && check && !*check) {
+		*check = CSUM_MANGLED_0;
+	}
+}
+
+// Where a frame for h_dest goes: the twin, or the mesh port that owns
+// the address, found in O(1) in the forwarding table. Called under
+// RCU; the port may be on its way down, which snull_enqueue_buf()
+// checks.
+static struct net_device *snull_dest(struct snull_priv *priv, const u8 *h_dest) {
+	struct snull_priv *port;
+
+	if (priv->mode == SNULL_TWIN) {
+		return rcu_dereference(priv->peer);
+	}
+	port = rhashtable_lookup(&snull_fdb, h_dest, snull_fdb_params);
+	return port ? port->dev : NULL;
 }
 
-// Transmit a packet (low level interface)
-static void snull_hw_tx(char *buf, int len, struct net_device *dev) {
+// Queue the len bytes of frame in the descriptor on dest, on the
+// receive queue picked by the flow hash or, without one, the queue
+// matching ours. The descriptor is given back on failure.
+static int snull_deliver_buf(struct snull_queue *q, struct net_device *dest,
+				struct snull_packet *tx_buffer, int len, u32 hash,
+				enum pkt_hash_types hash_type) {
+	struct snull_priv *priv = netdev_priv(q->dev), *dpriv = netdev_priv(dest);
+	struct snull_queue *rxq;
+	struct ethhdr *eth;
+	u8 *buf = tx_buffer->data;
+
+	// Pad to ETH_ZLEN
+	if (len < ETH_ZLEN) {
+		memset(buf + len, 0, ETH_ZLEN - len);
+		len = ETH_ZLEN;
+	}
+
+	// Ethhdr is 14 bytes, but the kernel arranges for iphdr
+	// to be aligned (i.e., ethhdr is unaligned)
+	eth = (struct ethhdr *)buf;
+	if (priv->mode == SNULL_TWIN && eth->h_proto == htons(ETH_P_IP) &&
+			len >= sizeof(struct ethhdr) + sizeof(struct iphdr)) {
+		snull_flip_addrs((struct iphdr *)(eth + 1), NULL,
+				len - sizeof(struct ethhdr));
+	}
+
+	tx_buffer->datalen = len;
+	tx_buffer->hash = hash;
+	tx_buffer->hash_type = hash_type;
+	if (hash_type == PKT_HASH_TYPE_NONE) {
+		rxq = &dpriv->q[q->index % dpriv->nqueues];
+	} else {
+		rxq = &dpriv->q[reciprocal_scale(hash, dpriv->nqueues)];
+	}
+	if (snull_link_send(q, rxq, tx_buffer, len)) {
+		snull_release_buffer(tx_buffer);
+		return -ENOBUFS;
+	}
+	return 0;
+}
+
+// Copy the skb into the descriptor and queue it on dest. The skb
+// stays ours.
+static int snull_deliver(struct snull_queue *q, struct net_device *dest,
+				struct sk_buff *skb, struct snull_packet *tx_buffer) {
+	u32 hash;
+
+	// RSS: the flow hash (5-tuple, looking through tunnels) picks
+	// the receive queue, so a flow always lands on the same queue.
+	// The receiving stack gets the hash along with the packet.
+	hash = skb_get_hash(skb);
+
+	// DMA the frame, gathering the fragments and filling in a
+	// checksum left partial by the stack
+	skb_copy_and_csum_dev(skb, tx_buffer->data);
+	return snull_deliver_buf(q, dest, tx_buffer, skb->len, hash,
+			skb->l4_hash ? PKT_HASH_TYPE_L4 : PKT_HASH_TYPE_L3);
+}
+
+// Zerocopy: hand the skb itself to dest. Both the skb and, on
+// failure, the descriptor are consumed whatever happens.
+static int snull_deliver_zc(struct snull_queue *q, struct net_device *dest,
+				struct sk_buff *skb, struct snull_packet *tx_buffer) {
+	struct snull_priv *dpriv = netdev_priv(dest);
+	struct snull_queue *rxq;
+	u32 hash;
+
+	hash = skb_get_hash(skb);
+	tx_buffer->hash = hash;
+	tx_buffer->hash_type = skb->l4_hash ? PKT_HASH_TYPE_L4 : PKT_HASH_TYPE_L3;
+	tx_buffer->datalen = skb->len;	// in case XDP wants a copy
+
+	// __dev_forward_skb() scrubs our state from the skb and
+	// consumes it on failure
+	if (__dev_forward_skb(dest, skb)) {
+		snull_release_buffer(tx_buffer);
+		return -EINVAL;
+	}
+	rxq = &dpriv->q[reciprocal_scale(hash, dpriv->nqueues)];
+	tx_buffer->skb = skb;
+	if (snull_link_send(q, rxq, tx_buffer, skb->len + ETH_HLEN)) {
+		kfree_skb(skb);
+		snull_release_buffer(tx_buffer);
+		return -ENOBUFS;
+	}
+	return 0;
+}
+
+// Zerocopy for XDP frames: hand the frame itself to dest, which
+// copies it into a page of its own pool, so no skb is built for it.
+// The frame and, on failure, the descriptor are consumed whatever
+// happens.
+static int snull_deliver_frame(struct snull_queue *q, struct net_device *dest,
+				struct snull_packet *tx_buffer, struct xdp_frame *xdpf) {
+	struct snull_priv *priv = netdev_priv(q->dev), *dpriv = netdev_priv(dest);
+	struct ethhdr *eth = xdpf->data;
+	int len = xdpf->len;
+
+	// Another driver's frame may have less headroom than ours
+	if (!SNULL_RX_FITS(max(len, ETH_ZLEN))) {
+		xdp_return_frame(xdpf);
+		snull_release_buffer(tx_buffer);
+		return -EMSGSIZE;
+	}
+
+	// The frame is ours now: rewrite the twin's addresses in place
+	if (priv->mode == SNULL_TWIN && eth->h_proto == htons(ETH_P_IP) &&
+			len >= sizeof(struct ethhdr) + sizeof(struct iphdr)) {
+		snull_flip_addrs((struct iphdr *)(eth + 1), NULL,
+				len - sizeof(struct ethhdr));
+	}
+
+	tx_buffer->xdpf = xdpf;
+	tx_buffer->datalen = max(len, ETH_ZLEN);	// padded by the copy
+	tx_buffer->hash = 0;
+	tx_buffer->hash_type = PKT_HASH_TYPE_NONE;
+	if (snull_link_send(q, &dpriv->q[q->index % dpriv->nqueues], tx_buffer,
+				tx_buffer->datalen)) {
+		snull_free_payload(tx_buffer);
+		snull_release_buffer(tx_buffer);
+		return -ENOBUFS;
+	}
+	return 0;
+}
+
+// Broadcast and multicast on the mesh go to every other running port,
+// each copy with a descriptor of its own, tx_buffer being the first.
+// Out of descriptors, the remaining ports miss the frame.
+static void snull_flood(struct snull_queue *q, struct sk_buff *skb,
+				struct snull_packet *tx_buffer) {
+	struct snull_priv *port;
+	struct snull_packet *desc;
+	struct sk_buff *nskb;
+
+	list_for_each_entry_rcu(port, &snull_ports, port) {
+		if (port->dev == q->dev) {
+			continue;
+		}
+		desc = tx_buffer ? tx_buffer : __ptr_ring_consume(&q->pool);
+		tx_buffer = NULL;
+		if (!desc) {
+			snull_stats_add(&q->tx_stats, dropped, 1);
+			break;
+		}
+		if (!zerocopy) {
+			snull_deliver(q, port->dev, skb, desc);
+		} else if ((nskb = skb_clone(skb, GFP_ATOMIC))) {
+			snull_deliver_zc(q, port->dev, nskb, desc);
+		} else {
+			snull_release_buffer(desc);
+		}
+	}
+	if (tx_buffer) {
+		snull_release_buffer(tx_buffer);
+	}
+}
+
+// The frame is on the wire: count it, and keep the skb, if it is
+// still ours, for the next TX completion to free
+static void snull_tx_sent(struct snull_queue *q, struct sk_buff *skb, int len) {
+	u64_stats_update_begin(&q->tx_stats.syncp);
+	q->tx_stats.packets++;
+	q->tx_stats.bytes += len;
+	u64_stats_update_end(&q->tx_stats.syncp);
+	if (skb) {
+		spin_lock(&q->lock);
+		__skb_queue_tail(&q->tx_done, skb);
+		spin_unlock(&q->lock);
+	}
+}
+
+// Transmit a packet (low level interface), in the descriptor tx_buffer
+static void snull_hw_tx(struct sk_buff *skb, struct snull_queue *q,
+				struct snull_packet *tx_buffer) {
 	// This function deals with hw details. This function loops
 	// back the packet to the other snull interface (if any).
 	// In other words, this function implements the snull behaviour,
 	// while all other procedures are rather device-independent
-	struct iphdr *ih;
+	struct snull_priv *priv = netdev_priv(q->dev);
 	struct net_device *dest;
-	struct snull_priv *priv;
-	u32 *saddr, *daddr;
-	struct snull_packet *tx_buffer;
+	int len = skb->len, err = 0;
 
-	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
-		printk("snull: Hmm... packet too short (%i octets)\n", len);
-		return;
+	if (len < ETH_HLEN || len > ETH_HLEN + SNULL_MAX_MTU) {
+		snull_release_buffer(tx_buffer);
+		goto drop;
 	}
 
-	// Ethhdr is 14 bytes, but the kernel arranges for iphdr
-	// to be aligned (i.e., ethhdr is unaligned)
-	ih = (struct iphdr *)(buf+sizeof(struct ethhdr));
-	saddr = &ih->saddr;
-	daddr = &ih->daddr;
+	// Ok, now the packet is ready for transmissin: first simulate a
+	// receive interrupt on the destination, then a transmission-done
+	// on the transmitting device
+	rcu_read_lock();
+	if (priv->mode == SNULL_MESH && is_multicast_ether_addr(skb->data)) {
+		snull_flood(q, skb, tx_buffer);
+	} else if ((dest = snull_dest(priv, skb->data)) && dest != q->dev) {
+		err = snull_deliver(q, dest, skb, tx_buffer);
+	} else {
+		snull_release_buffer(tx_buffer);
+		err = -ENOENT;
+	}
+	rcu_read_unlock();
+	if (err) {
+		goto drop;
+	}
+
+	snull_tx_sent(q, skb, max(len, ETH_ZLEN));
+	return;
+
+drop:
+	snull_stats_add(&q->tx_stats, dropped, 1);
+	dev_kfree_skb_any(skb);
+}
 
-	((u8 *)saddr)[2] ^= 1;	// change the third octet (class C)
-	((u8 *)daddr)[2] ^= 1;
+// The zerocopy "hardware": the destination receives the very skb we
+// were given, after the twin has its addresses rewritten in place,
+// and the sender completes the transmission without freeing it. A
+// GSO skb crosses as one unit, as between a pair of veths.
+static void snull_hw_tx_zc(struct sk_buff *skb, struct snull_queue *q,
+				struct snull_packet *tx_buffer) {
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct sk_buff *done = NULL;
+	struct net_device *dest;
+	struct iphdr *ih;
+	int len = skb->len, err = 0;
 
-	ih->check = 0;		// and rebuild the checksum (ip needs it)
-	ih->check = ip_fast_csum((unsigned char *)ih, ih->ihl);
+	if (priv->mode == SNULL_TWIN &&
+			((struct ethhdr *)skb->data)->h_proto == htons(ETH_P_IP)) {
+		if (!pskb_may_pull(skb, sizeof(struct ethhdr) + sizeof(struct iphdr))) {
+			goto drop;
+		}
+		// Bring the L4 header into the linear part too, if it is there
+		ih = (struct iphdr *)(skb->data + sizeof(struct ethhdr));
+		pskb_may_pull(skb, min_t(int, len, sizeof(struct ethhdr) + ih->ihl * 4 +
+					sizeof(struct tcphdr)));
+		// The header may be shared with a clone (TCP keeps one for
+		// retransmission): get a private copy before writing to it
+		if (skb_cow_head(skb, 0)) {
+			goto drop;
+		}
+		snull_flip_addrs((struct iphdr *)(skb->data + sizeof(struct ethhdr)), skb,
+				skb_headlen(skb) - sizeof(struct ethhdr));
+	}
 
-	if (dev == snull_devs[0]) {
-		printk("%08x:%05i --> %08x:%05i\n",
-				ntohl(ih->saddr), ntohs(((struct tcphdr*)(ih+1))->source),
-				ntohl(ih->daddr), ntohs(((struct tcphdr*)(ih+1))->dest));
+	rcu_read_lock();
+	if (priv->mode == SNULL_MESH && is_multicast_ether_addr(skb->data)) {
+		snull_flood(q, skb, tx_buffer);
+		done = skb;	// the ports got clones, the original is ours
+	} else if ((dest = snull_dest(priv, skb->data)) && dest != q->dev) {
+		err = snull_deliver_zc(q, dest, skb, tx_buffer);
 	} else {
-		printk("%08x:%05i <-- %08x:%05i\n",
-				ntohl(ih->daddr), ntohs(((struct tcphdr*)(ih+1))->dest),
-				ntohl(ih->saddr), ntohs(((struct tcphdr*)(ih+1))->source));
+		snull_release_buffer(tx_buffer);
+		kfree_skb(skb);
+		err = -ENOENT;
+	}
+	rcu_read_unlock();
+	if (err) {
+		snull_stats_add(&q->tx_stats, dropped, 1);
+		return;
 	}
 
-	// Ok, now the packet is ready for transmissin: first simulate a
-	// receive interrupt on the twin device, then a transmission-done
-	// on the transmitting device
-	dest = snull_devs[dev == snull_devs[0] ? 1 : 0];
-	priv = netdev_priv(dest);
-	tx_buffer = snull_get_tx_buffer(dev);
-	tx_buffer->datalen = len;
-	memcpy(tx_buffer->data, buf, len);
-	snull_enqueue_buf(dest, tx_buffer);
-	if (priv->rx_int_enabled) {
-		priv->status |= SNULL_RX_INTR;
-		snull_interrupt(0, dest, NULL);
+	snull_tx_sent(q, done, len);
+	return;
+
+drop:
+	snull_stats_add(&q->tx_stats, dropped, 1);
+	kfree_skb(skb);
+	snull_release_buffer(tx_buffer);
+}
+
+// Send XDP frames out of the TX queue matching q: those an XDP
+// program bounced (XDP_TX) and those redirected to us. In copy mode a
+// frame goes straight into a descriptor, zerocopy the descriptor
+// carries the frame itself; no skb is involved either way. Floods on
+// the mesh need one and take the usual path. Returns how many frames
+// were taken, stopping short if the pool runs dry.
+static int snull_xdp_xmit_queue(struct snull_queue *q, int n, struct xdp_frame **frames) {
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+	struct snull_packet *desc;
+	struct net_device *dest;
+	struct xdp_frame *xdpf;
+	struct sk_buff *skb;
+	int i, len, err;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		xdpf = frames[i];
+		desc = __ptr_ring_consume(&q->pool);
+		if (!desc) {
+			snull_stats_add(&q->tx_stats, pool_empty, 1);
+			break;
+		}
+		if (priv->mode == SNULL_MESH && is_multicast_ether_addr(xdpf->data)) {
+			skb = xdp_build_skb_from_frame(xdpf, q->dev);
+			if (!skb) {
+				snull_release_buffer(desc);
+				xdp_return_frame(xdpf);
+				snull_stats_add(&q->tx_stats, dropped, 1);
+				continue;
+			}
+			skb_push(skb, ETH_HLEN);	// undo eth_type_trans()
+			if (zerocopy) {
+				snull_hw_tx_zc(skb, q, desc);
+			} else {
+				snull_hw_tx(skb, q, desc);
+			}
+			continue;
+		}
+
+		len = xdpf->len;
+		dest = snull_dest(priv, xdpf->data);
+		if (len < ETH_HLEN || len > ETH_HLEN + SNULL_MAX_MTU ||
+				!dest || dest == q->dev) {
+			snull_release_buffer(desc);
+			xdp_return_frame(xdpf);
+			snull_stats_add(&q->tx_stats, dropped, 1);
+			continue;
+		}
+		if (zerocopy) {
+			err = snull_deliver_frame(q, dest, desc, xdpf);
+		} else {
+			memcpy(desc->data, xdpf->data, len);
+			xdp_return_frame(xdpf);
+			err = snull_deliver_buf(q, dest, desc, len, 0, PKT_HASH_TYPE_NONE);
+		}
+		if (err) {
+			snull_stats_add(&q->tx_stats, dropped, 1);
+			continue;
+		}
+		u64_stats_update_begin(&q->tx_stats.syncp);
+		q->tx_stats.packets++;
+		q->tx_stats.bytes += max(len, ETH_ZLEN);
+		u64_stats_update_end(&q->tx_stats.syncp);
 	}
+	rcu_read_unlock();
+	if (!skb_queue_empty_lockless(&q->tx_done)) {
+		snull_tx_kick(q);
+	}
+	__netif_tx_unlock(txq);
+	return i;
+}
 
-	priv = netdev_priv(dev);
-	priv->tx_packetlen = len;
-	priv->tx_packetdata = buf;
-	priv->status |= SNULL_TX_INTR;
-	snull_interrupt(0, dev, NULL);
+// ndo_xdp_xmit: frames redirected to us by XDP elsewhere. Those not
+// taken are freed by the caller.
+static int snull_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames,
+				u32 flags) {
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (flags & ~XDP_XMIT_FLAGS_MASK) {
+		return -EINVAL;
+	}
+	if (!netif_running(dev)) {
+		return -ENETDOWN;
+	}
+	return snull_xdp_xmit_queue(&priv->q[smp_processor_id() % priv->nqueues],
+			n, frames);
 }
 
-// Transmit a packet (called by the kernel)
+// Transmit a packet (called by the kernel). The stack holds the
+// lock of the TX queue, so only one CPU is ever in here per queue.
 int snull_tx(struct sk_buff *skb, struct net_device *dev) {
-	int len;
-	char *data, shortpkt[ETH_ZLEN];
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = &priv->q[skb_get_queue_mapping(skb)];
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, q->index);
+	struct sk_buff *segs, *next;
+	int needed = 1, i = 0, len = skb->len;
+
+	// The copying "hardware" has TSO: it cuts super-packets into
+	// MTU-sized frames itself, one descriptor each
+	if (!zerocopy && skb_is_gso(skb)) {
+		needed = skb_shinfo(skb)->gso_segs;
+	}
 
-	data = skb->data;
-	len = skb->len;
-	if (len < ETH_ZLEN) {
-		memset(shortpkt, 0, ETH_ZLEN);
-		memcpy(shortpkt, skb->data, skb->len);
-		len = ETH_ZLEN;
-		data = shortpkt;
+	// Out of descriptors: push back on the stack, which requeues
+	// the skb, until the twin returns some. Nothing is dropped.
+	if (snull_get_tx_buffers(q, needed)) {
+		snull_stats_add(&q->tx_stats, pool_empty, 1);
+		snull_tx_stop(q, txq);
+		snull_tx_kick(q);	// for what xmit_more held back
+		return NETDEV_TX_BUSY;
 	}
-	dev->trans_start = jiffies;	// Save the timestamp
 
-	// Remember the skb, so we can free it at interrupt time
-	priv->skb = skb;
+	// BQL: the bytes are in flight from now on, until the TX
+	// completion that reaps them, whatever becomes of the skb
+	netdev_tx_sent_queue(txq, len);
+	spin_lock(&q->lock);
+	q->tx_done_pkts++;
+	q->tx_done_bytes += len;
+	spin_unlock(&q->lock);
+
+	if (zerocopy) {
+		snull_hw_tx_zc(skb, q, q->descs[0]);
+	} else if (skb_is_gso(skb)) {
+		segs = skb_gso_segment(skb, NETIF_F_SG | NETIF_F_HW_CSUM);
+		if (IS_ERR_OR_NULL(segs)) {
+			snull_stats_add(&q->tx_stats, dropped, 1);
+			dev_kfree_skb_any(skb);
+		} else {
+			consume_skb(skb);
+			skb_list_walk_safe(segs, skb, next) {
+				skb_mark_not_on_list(skb);
+				if (i < needed) {
+					snull_hw_tx(skb, q, q->descs[i++]);
+				} else {
+					snull_stats_add(&q->tx_stats, dropped, 1);
+					dev_kfree_skb_any(skb);
+				}
+			}
+		}
+		while (i < needed) {
+			snull_release_buffer(q->descs[i++]);
+		}
+	} else {
+		// actual deliver of data is device-specific, and not shown here
+		snull_hw_tx(skb, q, q->descs[0]);
+	}
 
-	// actual deliver of data is device-specific, and not shown here
-	snull_hw_tx(data, len, dev);
+	// Stop before the pool runs dry rather than after
+	if (__ptr_ring_empty(&q->pool)) {
+		snull_tx_stop(q, txq);
+	}
+	// Ring the doorbell once the stack has nothing more right
+	// behind this one, or can't send it anyway
+	if (!netdev_xmit_more() || netif_xmit_stopped(txq)) {
+		snull_tx_kick(q);
+	}
+	return NETDEV_TX_OK;
+}
 
-	return 0;	// Our simple device can not fail
+// Whether what priv sends to h_dest goes through an XDP program on
+// the way in. Called under RCU.
+static bool snull_dest_xdp(struct snull_priv *priv, const u8 *h_dest) {
+	struct snull_priv *port;
+	struct net_device *dest;
+
+	if (priv->mode == SNULL_MESH && is_multicast_ether_addr(h_dest)) {
+		list_for_each_entry_rcu(port, &snull_ports, port) {
+			if (port != priv && rcu_access_pointer(port->xdp_prog)) {
+				return true;
+			}
+		}
+		return false;
+	}
+	dest = snull_dest(priv, h_dest);
+	return dest && rcu_access_pointer(((struct snull_priv *)netdev_priv(dest))->xdp_prog);
+}
+
+// Zerocopy hands super-packets over whole, but XDP takes frames of a
+// page at most: have the stack cut those bound for a program first
+static netdev_features_t snull_features_check(struct sk_buff *skb,
+				struct net_device *dev, netdev_features_t features) {
+	features = vlan_features_check(skb, features);
+	if (zerocopy && skb_is_gso(skb)) {
+		rcu_read_lock();
+		if (snull_dest_xdp(netdev_priv(dev), skb->data)) {
+			features &= ~NETIF_F_GSO_MASK;
+		}
+		rcu_read_unlock();
+	}
+	return features;
+}
+
+// Jumbo frames, up to SNULL_MAX_MTU, or a page's worth under XDP
+int snull_change_mtu(struct net_device *dev, int new_mtu) {
+	struct snull_priv *priv = netdev_priv(dev);
+
+	// check ranges
+	if ((new_mtu < ETH_MIN_MTU) || (new_mtu > SNULL_MAX_MTU)) {
+		return -EINVAL;
+	}
+	if (rtnl_dereference(priv->xdp_prog) && new_mtu > SNULL_XDP_MAX_MTU) {
+		return -EINVAL;
+	}
+	dev->mtu = new_mtu;
+	return 0;
+}
+
+// The RX page_pool of a queue, big enough to recycle a full receive
+// ring. The "hardware" copies into the pages, so no DMA mapping.
+static int snull_setup_page_pool(struct snull_queue *q, int nqueues) {
+	struct page_pool_params pp = {
+		.order		= 0,
+		.pool_size	= pool_size * nqueues,
+		.nid		= NUMA_NO_NODE,
+	};
+	struct page_pool *pool;
+
+	pool = page_pool_create(&pp);
+	if (IS_ERR(pool)) {
+		return PTR_ERR(pool);
+	}
+	q->page_pool = pool;
+	return 0;
+}
+
+// Set up the queues. Called by register_netdev(), once the core
+// has allocated its TX queues.
+static int snull_dev_init(struct net_device *dev) {
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	int i;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		q = &priv->q[i];
+		spin_lock_init(&q->lock);
+		skb_queue_head_init(&q->tx_done);
+		u64_stats_init(&q->rx_stats.syncp);
+		u64_stats_init(&q->tx_stats.syncp);
+		q->dev = dev;
+		q->index = i;
+		if (use_napi) {
+			netif_napi_add(dev, &q->napi, snull_poll, napi_weight);
+		}
+		snull_rx_ints(q, 1);	// enable receive interrupts
+		if (snull_setup_pool(q, priv->nqueues) ||
+				snull_setup_page_pool(q, priv->nqueues) ||
+				xdp_rxq_info_reg(&q->xdp_rxq, dev, i, q->napi.napi_id) ||
+				xdp_rxq_info_reg_mem_model(&q->xdp_rxq, MEM_TYPE_PAGE_POOL,
+						q->page_pool)) {
+			snull_teardown_pool(dev);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+// Unregistering: a twin leaves its twin without a peer
+static void snull_uninit(struct net_device *dev) {
+	struct snull_priv *priv = netdev_priv(dev), *ppriv;
+	struct net_device *peer = rtnl_dereference(priv->peer);
+
+	if (peer) {
+		ppriv = netdev_priv(peer);
+		RCU_INIT_POINTER(ppriv->peer, NULL);
+		RCU_INIT_POINTER(priv->peer, NULL);
+	}
+}
+
+// Attach or detach the XDP program. It runs in the NAPI poll, so
+// there is no native XDP without use_napi. In zerocopy mode, frames
+// for the program are copied into the page_pool on the way in, as in
+// copy mode, instead of arriving as the sender's skb.
+static int snull_xdp_set(struct net_device *dev, struct bpf_prog *prog,
+				struct netlink_ext_ack *extack) {
+	struct snull_priv *priv = netdev_priv(dev);
+	struct bpf_prog *old;
+
+	if (prog && !use_napi) {
+		NL_SET_ERR_MSG_MOD(extack, "native XDP needs use_napi=1");
+		return -EOPNOTSUPP;
+	}
+	if (prog && dev->mtu > SNULL_XDP_MAX_MTU) {
+		NL_SET_ERR_MSG_MOD(extack, "MTU too large for XDP");
+		return -EOPNOTSUPP;
+	}
+	old = rtnl_dereference(priv->xdp_prog);
+	rcu_assign_pointer(priv->xdp_prog, prog);
+	if (old) {
+		bpf_prog_put(old);
+	}
+	return 0;
+}
+
+static int snull_bpf(struct net_device *dev, struct netdev_bpf *xdp) {
+	switch (xdp->command) {
+	case XDP_SETUP_PROG:
+		return snull_xdp_set(dev, xdp->prog, xdp->extack);
+	default:
+		return -EINVAL;
+	}
 }
 
 static const struct net_device_ops snull_netdev_ops = {
+	.ndo_init		= snull_dev_init,
+	.ndo_uninit		= snull_uninit,
 	.ndo_open		= snull_open,
 	.ndo_stop		= snull_release,
 	.ndo_set_config	= snull_config,
 	.ndo_start_xmit	= snull_tx,
+	.ndo_features_check	= snull_features_check,
 	.ndo_do_ioctl	= snull_ioctl,
-	.ndo_get_stats	= snull_stats,
-	//.ndo_change_mtu	= snull_change_mtu,
+	.ndo_get_stats64	= snull_get_stats64,
+	.ndo_change_mtu	= snull_change_mtu,
 	.ndo_tx_timeout	= snull_tx_timeout,
+	.ndo_set_mac_address	= eth_mac_addr,
+	.ndo_validate_addr	= eth_validate_addr,
+	.ndo_bpf		= snull_bpf,
+	.ndo_xdp_xmit		= snull_xdp_xmit,
+};
+
+// ethtool -S: the counters of every queue, rxN_* and txN_*
+static const char snull_rx_strings[][ETH_GSTRING_LEN] = {
+	"packets", "bytes", "drops", "fifo_errors",
+	"napi_0", "napi_1", "napi_2_3", "napi_4_7",
+	"napi_8_15", "napi_16_31", "napi_32_63", "napi_64_plus",
+	"xdp_drop", "xdp_tx", "xdp_redirect",
+};
+
+static const char snull_tx_strings[][ETH_GSTRING_LEN] = {
+	"packets", "bytes", "drops", "errors", "pool_empty", "link_lost",
+	"doorbells",
+};
+
+#define SNULL_RX_NSTATS	ARRAY_SIZE(snull_rx_strings)
+#define SNULL_TX_NSTATS	ARRAY_SIZE(snull_tx_strings)
+
+static void snull_get_drvinfo(struct net_device *dev, struct ethtool_drvinfo *info) {
+	strscpy(info->driver, "snull", sizeof(info->driver));
+}
+
+static int snull_get_sset_count(struct net_device *dev, int sset) {
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (sset != ETH_SS_STATS) {
+		return -EOPNOTSUPP;
+	}
+	return priv->nqueues * (SNULL_RX_NSTATS + SNULL_TX_NSTATS);
+}
+
+static void snull_get_strings(struct net_device *dev, u32 sset, u8 *data) {
+	struct snull_priv *priv = netdev_priv(dev);
+	int i, j;
+
+	if (sset != ETH_SS_STATS) {
+		return;
+	}
+	for (i = 0; i < priv->nqueues; i++) {
+		for (j = 0; j < SNULL_RX_NSTATS; j++) {
+			ethtool_sprintf(&data, "rx%d_%s", i, snull_rx_strings[j]);
+		}
+		for (j = 0; j < SNULL_TX_NSTATS; j++) {
+			ethtool_sprintf(&data, "tx%d_%s", i, snull_tx_strings[j]);
+		}
+	}
+}
+
+static void snull_get_ethtool_stats(struct net_device *dev,
+				struct ethtool_stats *stats, u64 *data) {
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	unsigned int start;
+	int i, j;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		q = &priv->q[i];
+		do {
+			start = u64_stats_fetch_begin(&q->rx_stats.syncp);
+			data[0] = q->rx_stats.packets;
+			data[1] = q->rx_stats.bytes;
+			data[2] = q->rx_stats.dropped;
+			for (j = 0; j < SNULL_NAPI_BUCKETS; j++) {
+				data[4 + j] = q->rx_stats.napi_hist[j];
+			}
+			data[4 + j] = q->rx_stats.xdp_drop;
+			data[5 + j] = q->rx_stats.xdp_tx;
+			data[6 + j] = q->rx_stats.xdp_redirect;
+		} while (u64_stats_fetch_retry(&q->rx_stats.syncp, start));
+		data[3] = atomic64_read(&q->rx_fifo_errors);
+		data += SNULL_RX_NSTATS;
+
+		do {
+			start = u64_stats_fetch_begin(&q->tx_stats.syncp);
+			data[0] = q->tx_stats.packets;
+			data[1] = q->tx_stats.bytes;
+			data[2] = q->tx_stats.dropped;
+			data[3] = q->tx_stats.errors;
+			data[4] = q->tx_stats.pool_empty;
+			data[5] = q->tx_stats.link_lost;
+			data[6] = q->tx_stats.doorbells;
+		} while (u64_stats_fetch_retry(&q->tx_stats.syncp, start));
+		data += SNULL_TX_NSTATS;
+	}
+}
+
+static const struct ethtool_ops snull_ethtool_ops = {
+	.get_drvinfo		= snull_get_drvinfo,
+	.get_link		= ethtool_op_get_link,
+	.get_sset_count		= snull_get_sset_count,
+	.get_strings		= snull_get_strings,
+	.get_ethtool_stats	= snull_get_ethtool_stats,
 };
 
 static const struct header_ops snull_header_ops = {
@@ -396,8 +1809,111 @@ static const struct header_ops snull_header_ops = {
 	.cache	= NULL,
 };
 
+// Link emulation, in /sys/class/net/snX/snull/: rate (bit/s), delay
+// and jitter (ns) and loss (parts per million), all 0 by default. The
+// delay lines are only allocated the first time one is set.
+static int snull_link_update(struct net_device *dev) {
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_link *link = &priv->link;
+	struct snull_wheel *w;
+	int i;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		if (priv->q[i].wheel) {
+			continue;
+		}
+		w = kzalloc(sizeof(*w), GFP_KERNEL);
+		if (!w) {
+			return -ENOMEM;
+		}
+		spin_lock_init(&w->lock);
+		hrtimer_init(&w->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+		w->timer.function = snull_wheel_fire;
+		w->clock = ktime_get_ns() >> SNULL_WHEEL_SHIFT;
+		w->next = U64_MAX;
+		priv->q[i].wheel = w;
+	}
+	// Publish the wheels before the transmit path looks for them
+	smp_store_release(&link->active,
+			link->rate || link->delay || link->jitter || link->loss);
+	return 0;
+}
+
+static ssize_t snull_link_show(struct device *d, char *buf, size_t offset) {
+	struct snull_priv *priv = netdev_priv(to_net_dev(d));
+	void *field = (void *)&priv->link + offset;
+
+	if (offset == offsetof(struct snull_link, rate) ||
+			offset == offsetof(struct snull_link, delay)) {
+		return sprintf(buf, "%llu\n", READ_ONCE(*(u64 *)field));
+	}
+	return sprintf(buf, "%u\n", READ_ONCE(*(u32 *)field));
+}
+
+static ssize_t snull_link_store(struct device *d, const char *buf, size_t count,
+				size_t offset) {
+	struct net_device *dev = to_net_dev(d);
+	struct snull_priv *priv = netdev_priv(dev);
+	void *field = (void *)&priv->link + offset;
+	u64 val;
+	int err;
+
+	err = kstrtou64(buf, 0, &val);
+	if (err) {
+		return err;
+	}
+	if ((offset == offsetof(struct snull_link, jitter) && val > S32_MAX) ||
+			(offset == offsetof(struct snull_link, loss) && val > 1000000)) {
+		return -EINVAL;
+	}
+	if (!rtnl_trylock()) {
+		return restart_syscall();
+	}
+	if (offset == offsetof(struct snull_link, rate) ||
+			offset == offsetof(struct snull_link, delay)) {
+		WRITE_ONCE(*(u64 *)field, val);
+	} else {
+		WRITE_ONCE(*(u32 *)field, val);
+	}
+	err = snull_link_update(dev);
+	rtnl_unlock();
+	return err ? err : count;
+}
+
+#define SNULL_LINK_ATTR(name) \
+static ssize_t name##_show(struct device *d, struct device_attribute *attr, \
+		char *buf) { \
+	return snull_link_show(d, buf, offsetof(struct snull_link, name)); \
+} \
+static ssize_t name##_store(struct device *d, struct device_attribute *attr, \
+		const char *buf, size_t count) { \
+	return snull_link_store(d, buf, count, offsetof(struct snull_link, name)); \
+} \
+static DEVICE_ATTR_RW(name)
+
+SNULL_LINK_ATTR(rate);
+SNULL_LINK_ATTR(delay);
+SNULL_LINK_ATTR(jitter);
+SNULL_LINK_ATTR(loss);
+
+static struct attribute *snull_link_attrs[] = {
+	&dev_attr_rate.attr,
+	&dev_attr_delay.attr,
+	&dev_attr_jitter.attr,
+	&dev_attr_loss.attr,
+	NULL,
+};
+
+static const struct attribute_group snull_link_group = {
+	.name	= "snull",
+	.attrs	= snull_link_attrs,
+};
+
+static struct rtnl_link_ops snull_link_ops;
+
 // The init function (sometimes called probe)
-// It is invoked by register_netdev()
+// It is invoked by alloc_netdev_mqs(), or by rtnetlink. It sets up
+// a mesh port, a plain Ethernet device; the twins are adjusted after.
 void snull_init(struct net_device *dev) {
 	struct snull_priv *priv;
 #if 0
@@ -411,48 +1927,132 @@ void snull_init(struct net_device *dev) {
 
 	dev->watchdog_timeo = timeout;
 
-	// keep the default flags, just add NOARP
-	dev->flags	|= IFF_NOARP;
-	dev->features |= NETIF_F_HW_CSUM;
+	// Checksum, scatter-gather and segmentation are all done by
+	// the "hardware", so 64K super-packets reach us in one piece
+	dev->features |= NETIF_F_HW_CSUM | NETIF_F_SG | NETIF_F_GSO |
+				NETIF_F_TSO | NETIF_F_TSO6;
+	dev->hw_features = dev->features;
+	dev->max_mtu = SNULL_MAX_MTU;
+	// A super-packet needs a descriptor per segment in copy mode
+	if (!zerocopy) {
+		dev->gso_max_segs = pool_size;
+	}
 	dev->netdev_ops = &snull_netdev_ops;
-	dev->header_ops = &snull_header_ops;
-
-	// Then, initialize the priv field. This encloses the statistics
-	// and a few private fields
+	dev->ethtool_ops = &snull_ethtool_ops;
+	dev->rtnl_link_ops = &snull_link_ops;
+	dev->sysfs_groups[0] = &snull_link_group;
+	dev->needs_free_netdev = true;
+	dev->priv_destructor = snull_teardown_pool;
+
+	// Then, initialize the priv field. The queues are set up
+	// by snull_dev_init()
 	priv = netdev_priv(dev);
-	memset(priv, 0, sizeof(struct snull_priv));
-	spin_lock_init(&priv->lock);
-	snull_rx_ints(dev, 1);	// enable receive interrupts
-	snull_setup_pool(dev);
+	priv->dev = dev;
+	priv->mode = SNULL_MESH;
+	priv->nqueues = snull_nqueues;
 }
 
+// Default XPS map: CPU c transmits on queue c % nqueues, so with
+// a queue per CPU every core keeps to its own queue and lock
+static void snull_set_xps(struct net_device *dev) {
+	struct snull_priv *priv = netdev_priv(dev);
+	cpumask_var_t mask;
+	int i, cpu;
 
-// Finally, the module stuff
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL)) {
+		return;
+	}
+	for (i = 0; i < priv->nqueues; i++) {
+		cpumask_clear(mask);
+		for_each_possible_cpu(cpu) {
+			if (cpu % priv->nqueues == i) {
+				cpumask_set_cpu(cpu, mask);
+			}
+		}
+		netif_set_xps_queue(dev, mask, i);
+	}
+	free_cpumask_var(mask);
+}
 
-void snull_cleanup(void) {
-	int i;
 
-	for (i = 0; i < 2; i++) {
-		if (snull_devs[i]) {
-			unregister_netdev(snull_devs[i]);
-			snull_teardown_pool(snull_devs[i]);
-			free_netdev(snull_devs[i]);
-		}
+// ip link add NAME type snull [address MAC]: a new port of the mesh
+static int snull_newlink(struct net *src_net, struct net_device *dev,
+				struct nlattr *tb[], struct nlattr *data[],
+				struct netlink_ext_ack *extack) {
+	int err;
+
+	if (!tb[IFLA_ADDRESS]) {
+		eth_hw_addr_random(dev);
+	}
+	err = register_netdevice(dev);
+	if (err) {
+		return err;
 	}
+	snull_set_xps(dev);
+	return 0;
+}
+
+static unsigned int snull_get_num_queues(void) {
+	return snull_nqueues;
+}
+
+static struct rtnl_link_ops snull_link_ops __read_mostly = {
+	.kind			= "snull",
+	.setup			= snull_init,
+	.newlink		= snull_newlink,
+	.get_num_tx_queues	= snull_get_num_queues,
+	.get_num_rx_queues	= snull_get_num_queues,
+};
+
+
+// Finally, the module stuff
+
+// Deleting the link type deletes every device of it, twins included
+void snull_cleanup(void) {
+	rtnl_link_unregister(&snull_link_ops);
+	rhashtable_destroy(&snull_fdb);
 }
 
 int snull_init_module(void) {
-	int result, i, ret = -ENOMEM;
+	int result, i, ret;
+	struct snull_priv *priv;
 
-	snull_interrupt = snull_regular_interrupt;
+	if (pool_size < 1) {
+		return -EINVAL;
+	}
+	snull_nqueues = queues > 0 ? queues : nr_cpu_ids;
+	snull_interrupt = use_napi ? snull_napi_interrupt : snull_regular_interrupt;
 
-	// Allocate the devices
-	snull_devs[0] = alloc_netdev(sizeof(struct snull_priv), "sn%d",
-				snull_init);
-	snull_devs[1] = alloc_netdev(sizeof(struct snull_priv), "sn%d",
-				snull_init);
-	if (snull_devs[0] == NULL || snull_devs[1] == NULL) {
-		goto out;
+	ret = rhashtable_init(&snull_fdb, &snull_fdb_params);
+	if (ret) {
+		return ret;
+	}
+	snull_link_ops.priv_size = struct_size(priv, q, snull_nqueues);
+	ret = rtnl_link_register(&snull_link_ops);
+	if (ret) {
+		rhashtable_destroy(&snull_fdb);
+		return ret;
+	}
+
+	// Allocate the twins, with a TX and an RX queue per CPU, and
+	// make them what snull always was: NOARP, with a header whose
+	// destination is the other one
+	ret = -ENOMEM;
+	for (i = 0; i < 2; i++) {
+		snull_devs[i] = alloc_netdev_mqs(snull_link_ops.priv_size, "sn%d",
+					NET_NAME_UNKNOWN, snull_init,
+					snull_nqueues, snull_nqueues);
+		if (snull_devs[i] == NULL) {
+			goto out;
+		}
+		snull_devs[i]->flags |= IFF_NOARP;
+		snull_devs[i]->header_ops = &snull_header_ops;
+		priv = netdev_priv(snull_devs[i]);
+		priv->mode = SNULL_TWIN;
+	}
+	for (i = 0; i < 2; i++) {
+		priv = netdev_priv(snull_devs[i]);
+		RCU_INIT_POINTER(priv->peer, snull_devs[!i]);
 	}
 
 	ret = -ENODEV;
@@ -460,13 +2060,24 @@ int snull_init_module(void) {
 		if ((result = register_netdev(snull_devs[i]))) {
 			printk("snull: error %i registering device %s\n",
 					result, snull_devs[i]->name);
+			priv = netdev_priv(snull_devs[!i]);
+			RCU_INIT_POINTER(priv->peer, NULL);
+			synchronize_net();
+			free_netdev(snull_devs[i]);
+			snull_devs[i] = NULL;
 		} else {
+			snull_set_xps(snull_devs[i]);
 			ret = 0;
 		}
 	}
 
 out:
 	if (ret) {
+		for (i = 0; i < 2; i++) {
+			if (snull_devs[i]) {
+				free_netdev(snull_devs[i]);
+			}
+		}
 		snull_cleanup();
 	}
 	return ret;